@@ -0,0 +1,102 @@
+/*
+ * Copyright ©2009  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include "config.h"
+#include "debug.h"
+#include "slmpc.h"
+#include "clock.h"
+
+/* Position in the current song, from the last status response. It's
+ * extrapolated from the local time while playing, so nothing needs to
+ * poll the server for it; a new status is only requested when the idle
+ * connection reports a change to the player.
+ *
+ * The tick count wraps after 49.7 days but only differences are used.
+ */
+
+void clock_reset(struct mpd_clock *clk) {
+	clk->state = MPD_UNKNOWN;
+	clk->elapsed = 0;
+	clk->duration = 0;
+	clk->tick = GetTickCount();
+}
+
+/* The state line comes first in a status response, before the position
+ * (if there is one), so it starts again from here
+ */
+void clock_sync(struct mpd_clock *clk, enum play_status state) {
+	clock_reset(clk);
+	clk->state = state;
+}
+
+/* "time: <elapsed>:<duration>" in whole seconds from older servers and
+ * then "elapsed: <seconds>" and "duration: <seconds>" with fractions from
+ * newer ones. Returns 1 if the line was used.
+ */
+int clock_parse(struct mpd_clock *clk, const char *msg_type, const char *value) {
+	unsigned long elapsed, duration;
+	char *end;
+
+	if (!strcmp(msg_type, "time:")) {
+		elapsed = strtoul(value, &end, 10);
+		if (*end != ':')
+			return 0;
+		duration = strtoul(end + 1, NULL, 10);
+
+		clk->elapsed = elapsed * 1000;
+		clk->duration = duration * 1000;
+		clk->tick = GetTickCount();
+	} else if (!strcmp(msg_type, "elapsed:")) {
+		clk->elapsed = (DWORD)(strtod(value, NULL) * 1000);
+		clk->tick = GetTickCount();
+	} else if (!strcmp(msg_type, "duration:")) {
+		clk->duration = (DWORD)(strtod(value, NULL) * 1000);
+	} else {
+		return 0;
+	}
+
+	odprintf("clock[parse]: state=%d elapsed=%lu duration=%lu", clk->state, clk->elapsed, clk->duration);
+	return 1;
+}
+
+/* Milliseconds into the song now, no further than the end if it's known */
+DWORD clock_elapsed(const struct mpd_clock *clk) {
+	DWORD elapsed = clk->elapsed;
+
+	if (clk->state == MPD_PLAYING)
+		elapsed += GetTickCount() - clk->tick;
+
+	if (clk->duration != 0 && elapsed > clk->duration)
+		elapsed = clk->duration;
+	return elapsed;
+}
+
+/* Length of the song in milliseconds, 0 if unknown (or a stream) */
+DWORD clock_duration(const struct mpd_clock *clk) {
+	return clk->duration;
+}
+
+/* Whether the position is moving */
+int clock_running(const struct mpd_clock *clk) {
+	return clk->state == MPD_PLAYING;
+}
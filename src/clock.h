@@ -0,0 +1,23 @@
+/*
+ * Copyright ©2009  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+void clock_reset(struct mpd_clock *clk);
+void clock_sync(struct mpd_clock *clk, enum play_status state);
+int clock_parse(struct mpd_clock *clk, const char *msg_type, const char *value);
+DWORD clock_elapsed(const struct mpd_clock *clk);
+DWORD clock_duration(const struct mpd_clock *clk);
+int clock_running(const struct mpd_clock *clk);
@@ -16,7 +16,9 @@
  */
 
 #include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <windows.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -26,23 +28,101 @@
 #include "slmpc.h"
 #include "comms.h"
 #include "tray.h"
+#include "clock.h"
 #include "keyboard.h"
 
-int comms_send(SOCKET s, const char *data);
-void comms_timer_start(HWND hWnd);
-void comms_timer_stop(HWND hWnd);
+int comms_send(SOCKET s, const char *data, int len);
+void comms_reset(struct comms_conn *conn);
+void comms_rtt_reset(struct comms_conn *conn);
+void comms_queue(struct comms_conn *conn, enum cmd_status cmd, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void comms_list_begin(struct comms_conn *conn);
+void comms_list_end(struct comms_conn *conn);
+void comms_queue_play(struct comms_conn *conn, enum cmd_status cmd);
+void comms_queue_keys(struct comms_conn *conn, struct slmpc_data *data);
+void comms_keys_reset(struct slmpc_data *data);
+void comms_state(struct slmpc_data *data, enum play_status play);
+void comms_tag(char *dst, size_t size, const char *value);
+int comms_song_parse(struct mpd_song *song, const char *msg_type, const char *value);
+void comms_song_check(HWND hWnd, struct slmpc_data *data);
+void comms_song_done(HWND hWnd, struct slmpc_data *data);
+int comms_song_inflight(struct slmpc_data *data);
+void comms_queue_idle(struct comms_conn *conn);
+void comms_queue_queries(struct comms_conn *conn, int status, int song);
+void comms_changed(struct slmpc_data *data, const char *name);
+void comms_changed_status(struct slmpc_data *data);
+void comms_dispatch(struct slmpc_data *data);
+void comms_optimistic(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd);
+int comms_keys_pending(struct slmpc_data *data);
+int comms_keys_inflight(struct comms_conn *conn);
+int comms_idle_tail(struct comms_conn *conn);
+int comms_noidle(struct comms_conn *conn);
+int comms_inflight(struct comms_conn *conn, enum cmd_status cmd);
+struct comms_cmd comms_pop(struct comms_conn *conn);
+int comms_rtt_work(enum cmd_status cmd);
+DWORD comms_rtt_timeout(const struct comms_conn *conn, enum cmd_status cmd);
+void comms_rtt_update(struct comms_conn *conn, const struct comms_cmd *entry);
+void comms_rtt_backoff(struct comms_conn *conn);
+int comms_flush(HWND hWnd, struct comms_conn *conn);
+void comms_close(HWND hWnd, struct slmpc_data *data);
+int comms_recv_grow(struct comms_conn *conn);
+void comms_recv_free(struct comms_conn *conn);
+int comms_read(HWND hWnd, struct slmpc_data *data, struct comms_conn *conn, DWORD *err);
+int comms_complete(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd);
+int comms_failed(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd, const char *line);
+void comms_timer_set(HWND hWnd, UINT_PTR id, UINT timeout);
+void comms_timer_kill(HWND hWnd, UINT_PTR id);
+void comms_timer_update(HWND hWnd, struct comms_conn *conn);
+SOCKET comms_socket(HWND hWnd, int family, const char **fail, DWORD *err);
+void comms_ctl_connect(HWND hWnd, struct slmpc_data *data);
+void comms_ctl_close(HWND hWnd, struct slmpc_data *data);
+void comms_ctl_lost(HWND hWnd, struct slmpc_data *data);
+int comms_ctl_activity(HWND hWnd, struct slmpc_data *data, WORD sEvent, WORD sError);
+int comms_ctl_complete(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd);
+int comms_ctl_failed(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd);
+int comms_ctl_run(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd);
+int comms_ctl_send(HWND hWnd, struct slmpc_data *data);
+int comms_ctl_keys(HWND hWnd, struct slmpc_data *data);
+void comms_enqueue(struct slmpc_data *data, enum cmd_status cmd);
+void comms_dequeue(struct slmpc_data *data, enum cmd_status cmd);
+int comms_play_queued(struct slmpc_data *data);
+void comms_drain_post(HWND hWnd, struct slmpc_data *data);
+int comms_drain_send(HWND hWnd, struct slmpc_data *data);
+#if HAVE_GETADDRINFO
+void comms_resolve_apply(struct slmpc_data *data, struct addrinfo *addrs_res);
+void comms_resolve_put(struct comms_resolve *req);
+DWORD WINAPI comms_resolve_thread(LPVOID param);
+int comms_resolve_start(HWND hWnd, struct slmpc_data *data);
+void comms_resolve_cancel(struct slmpc_data *data);
+void comms_resolve_drain(HWND hWnd);
+#endif
+void comms_addr_name(struct slmpc_data *data, const struct comms_addr *addr, char *hbuf, DWORD hlen, char *sbuf, DWORD slen);
+void comms_addr_promote(struct slmpc_data *data, unsigned int addr);
+int comms_attempt_start(HWND hWnd, struct slmpc_data *data, unsigned int addr);
+int comms_attempt_next(HWND hWnd, struct slmpc_data *data);
+void comms_attempt_close(struct slmpc_data *data, unsigned int i);
+void comms_attempt_abort(HWND hWnd, struct slmpc_data *data);
+void comms_attempt_timer(HWND hWnd, struct slmpc_data *data);
+int comms_attempt_activity(HWND hWnd, struct slmpc_data *data, unsigned int i, WORD sEvent, WORD sError);
+void comms_connect_report(struct slmpc_data *data);
+
+static inline unsigned int comms_family_index(int family) {
+	return family == AF_INET6 ? 1 : 0;
+}
+
+static inline const char *comms_family_name(int family) {
+	return family == AF_INET6 ? "IPv6" : "IPv4";
+}
 
 int comms_init(struct slmpc_data *data) {
-	INT ret;
-	DWORD err;
 #if HAVE_GETADDRINFO
-
 	odprintf("comms[init]: node=%s service=%s", data->node, data->service);
 
 	data->hbuf[0] = 0;
 	data->sbuf[0] = 0;
-	data->addrs_res = NULL;
-	data->addrs_cur = NULL;
+	data->addrs_count = 0;
+	data->addrs_next = 0;
+	data->attempts_count = 0;
+	memset(data->connect_stats, 0, sizeof(data->connect_stats));
 
 	data->hints.ai_flags = 0;
 	data->hints.ai_family = AF_UNSPEC;
@@ -53,475 +133,804 @@ int comms_init(struct slmpc_data *data) {
 	data->hints.ai_canonname = NULL;
 	data->hints.ai_next = NULL;
 
-	SetLastError(0);
-	ret = getaddrinfo(data->node, data->service, &data->hints, &data->addrs_res);
-	err = GetLastError();
-	odprintf("getaddrinfo: %d (%d)", ret, err);
-	if (ret != 0) {
-		mbprintf(TITLE, MB_OK|MB_ICONERROR, "Unable to resolve node \"%s\" service \"%s\" (%d)", data->node, data->service, ret);
-		return 1;
-	}
-
-	if (data->addrs_res == NULL) {
-		odprintf("no results");
-		mbprintf(TITLE, MB_OK|MB_ICONERROR, "No results resolving node \"%s\" service \"%s\"", data->node, data->service);
-		return 1;
-	}
-
-	data->addrs_cur = data->addrs_res;
+	data->resolving = NULL;
+	data->resolve_expired = 0;
 #else
-	int sa4_len = sizeof(data->sa4);
-	int sa6_len = sizeof(data->sa6);
+	struct comms_addr *addr;
+	INT ret;
+	DWORD err;
 
 	odprintf("comms[init]: node=%s service=%s", data->node, data->service);
 
-	data->family = AF_UNSPEC;
-	data->sa = NULL;
-	data->sa_len = 0;
+	data->addrs_count = 0;
+	data->addrs_next = 0;
+	data->attempts_count = 0;
+	memset(data->connect_stats, 0, sizeof(data->connect_stats));
 
+	addr = &data->addrs[data->addrs_count];
+	addr->sa_len = sizeof(addr->sa);
 	SetLastError(0);
-	ret = WSAStringToAddress(data->node, AF_INET, NULL, (LPSOCKADDR)&data->sa4, &sa4_len);
+	ret = WSAStringToAddress(data->node, AF_INET, NULL, (LPSOCKADDR)&addr->sa, &addr->sa_len);
 	err = GetLastError();
 	odprintf("WSAStringToAddress[IPv4]: %d (%ld)", ret, err);
 	if (ret == 0) {
-		data->family = AF_INET;
-		data->sa4.sin_family = AF_INET;
-		data->sa4.sin_port = htons(strtoul(data->service, NULL, 10));
+		struct sockaddr_in *sa4 = (struct sockaddr_in*)&addr->sa;
 
-		data->sa = (struct sockaddr*)&data->sa4;
-		data->sa_len = sa4_len;
+		addr->family = AF_INET;
+		sa4->sin_family = AF_INET;
+		sa4->sin_port = htons(strtoul(data->service, NULL, 10));
+		data->addrs_count++;
 	}
 
+	addr = &data->addrs[data->addrs_count];
+	addr->sa_len = sizeof(addr->sa);
 	SetLastError(0);
-	ret = WSAStringToAddress(data->node, AF_INET6, NULL, (LPSOCKADDR)&data->sa6, &sa6_len);
+	ret = WSAStringToAddress(data->node, AF_INET6, NULL, (LPSOCKADDR)&addr->sa, &addr->sa_len);
 	err = GetLastError();
 	odprintf("WSAStringToAddress[IPv6]: %d (%ld)", ret, err);
 	if (ret == 0) {
-		data->family = AF_INET6;
-		data->sa6.sin6_family = AF_INET6;
-		data->sa6.sin6_port = htons(strtoul(data->service, NULL, 10));
+		struct sockaddr_in6 *sa6 = (struct sockaddr_in6*)&addr->sa;
 
-		data->sa = (struct sockaddr*)&data->sa6;
-		data->sa_len = sa6_len;
+		addr->family = AF_INET6;
+		sa6->sin6_family = AF_INET6;
+		sa6->sin6_port = htons(strtoul(data->service, NULL, 10));
+		data->addrs_count++;
 	}
 
-	odprintf("family=%d", data->family);
-	if (data->family == AF_UNSPEC) {
+	odprintf("addrs=%u", data->addrs_count);
+	if (data->addrs_count == 0) {
 		mbprintf(TITLE, MB_OK|MB_ICONERROR, "Unable to connect: Invalid IP \"%s\"", data->node);
 		return 1;
 	}
 #endif
 
-	data->s = INVALID_SOCKET;
+	data->conn.s = INVALID_SOCKET;
+	data->conn.timer_id = CMD_TIMER_ID;
+	data->conn.recv_buf = NULL;
+	data->conn.recv_size = 0;
+	comms_reset(&data->conn);
+	comms_rtt_reset(&data->conn);
+	data->ctl.s = INVALID_SOCKET;
+	data->ctl.timer_id = CTL_CMD_TIMER_ID;
+	data->ctl.recv_buf = NULL;
+	data->ctl.recv_size = 0;
+	comms_reset(&data->ctl);
+	comms_rtt_reset(&data->ctl);
+	data->ctl_ready = 0;
+
+	data->hb_outstanding = 0;
+	data->hb_misses = 0;
+	data->replay = 0;
+	data->replay_cmd = MPC_NONE;
+
+	data->queue_count = 0;
+	data->drain_posted = 0;
+	comms_keys_reset(data);
 	return 0;
 }
 
 void comms_destroy(HWND hWnd, struct slmpc_data *data) {
 	odprintf("comms[destroy]");
 
+	comms_disconnect(hWnd, data);
+	comms_connect_report(data);
+
 #if HAVE_GETADDRINFO
-	if (data->addrs_res != NULL) {
-		freeaddrinfo(data->addrs_res);
-		data->addrs_res = NULL;
-	}
+	comms_resolve_drain(hWnd);
+	data->addrs_count = 0;
 #endif
-
-	comms_disconnect(hWnd, data);
 }
 
 void comms_disconnect(HWND hWnd, struct slmpc_data *data) {
-	INT ret;
-	DWORD err;
-
 	odprintf("comms[disconnect]");
 
 	data->status.conn = NOT_CONNECTED;
+	clock_reset(&data->clock);
+	data->idle_changed = 0;
+	data->status_song = -1;
+	data->status.song = -1;
+	data->status.volume = -1;
+	data->status.repeat = 0;
+	data->status.random = 0;
+	comms_song_reset(&data->song);
+	comms_song_reset(&data->song_next);
+
+	comms_attempt_abort(hWnd, data);
+#if HAVE_GETADDRINFO
+	comms_resolve_cancel(data);
+#endif
 
-	if (data->s != INVALID_SOCKET) {
-		comms_send(data->s, "close\n");
+	if (data->ctl.s != INVALID_SOCKET)
+		comms_send(data->ctl.s, "close\n", 6);
 
-		SetLastError(0);
-		ret = closesocket(data->s);
-		err = GetLastError();
-		odprintf("closesocket: %d (%ld)", ret, err);
+	if (data->conn.s != INVALID_SOCKET)
+		comms_send(data->conn.s, "close\n", 6);
 
-		data->s = INVALID_SOCKET;
-		comms_timer_stop(hWnd);
-		data->cmd = MPC_NONE;
-	}
+	comms_close(hWnd, data);
 }
 
-int comms_connect(HWND hWnd, struct slmpc_data *data) {
-	struct tray_status *status = &data->status;
-	struct tcp_keepalive ka_get;
-	struct tcp_keepalive ka_set = {
-		.onoff = 1,
-		.keepalivetime = 5000, /* 5 seconds */
-		.keepaliveinterval = 5000 /* 5 seconds */
-	};
-	int timeout = 5000; /* 5 seconds */
-	INT ret;
-	DWORD retd;
-	DWORD err;
+#if HAVE_GETADDRINFO
+static struct addrinfo *comms_resolve_find(struct addrinfo *cur, int family, int match) {
+	while (cur != NULL && (cur->ai_family == family) != match)
+		cur = cur->ai_next;
+	return cur;
+}
 
-	odprintf("comms[connect]");
+static void comms_resolve_add(struct slmpc_data *data, struct addrinfo *res) {
+	struct comms_addr *addr = &data->addrs[data->addrs_count];
 
-	if (!data->running)
-		return 0;
+	if (res->ai_addrlen > sizeof(addr->sa))
+		return;
 
-	if (data->s != INVALID_SOCKET)
-		return 0;
+	memcpy(&addr->sa, res->ai_addr, res->ai_addrlen);
+	addr->sa_len = res->ai_addrlen;
+	addr->family = res->ai_family;
+	data->addrs_count++;
+}
 
-	status->conn = NOT_CONNECTED;
-	tray_update(hWnd, data);
+/* Interleave address families, starting with the resolver's first choice,
+ * so that a dead route for one family only delays the other by one stagger
+ * interval instead of by every address it has.
+ */
+void comms_resolve_apply(struct slmpc_data *data, struct addrinfo *addrs_res) {
+	struct addrinfo *pref, *other;
+	int family;
 
-#if HAVE_GETADDRINFO
-	if (data->addrs_cur == NULL && data->addrs_res != NULL) {
-		freeaddrinfo(data->addrs_res);
-		data->addrs_res = NULL;
+	data->addrs_count = 0;
+	data->addrs_next = 0;
+	data->addrs_time = GetTickCount();
+	data->resolve_expired = 0;
+
+	if (addrs_res == NULL) {
+		odprintf("no results");
+		return;
 	}
 
-	if (data->addrs_res == NULL) {
-		SetLastError(0);
-		ret = getaddrinfo(data->node, data->service, &data->hints, &data->addrs_res);
-		err = GetLastError();
-		odprintf("getaddrinfo: %d (%ld)", ret, err);
-		if (ret != 0) {
-			ret = snprintf(status->msg, sizeof(status->msg), "Unable to resolve node \"%s\" service \"%s\" (%d)", data->node, data->service, ret);
-			if (ret < 0)
-				status->msg[0] = 0;
-			tray_update(hWnd, data);
+	family = addrs_res->ai_family;
+	pref = comms_resolve_find(addrs_res, family, 1);
+	other = comms_resolve_find(addrs_res, family, 0);
+	while ((pref != NULL || other != NULL) && data->addrs_count < COMMS_MAX_ADDRS) {
+		if (pref != NULL) {
+			comms_resolve_add(data, pref);
+			pref = comms_resolve_find(pref->ai_next, family, 1);
+		}
 
-			return 1;
+		if (other != NULL && data->addrs_count < COMMS_MAX_ADDRS) {
+			comms_resolve_add(data, other);
+			other = comms_resolve_find(other->ai_next, family, 0);
 		}
+	}
 
-		if (data->addrs_res == NULL) {
-			odprintf("no results");
-			ret = snprintf(status->msg, sizeof(status->msg), "No results resolving node \"%s\" service \"%s\"", data->node, data->service);
-			if (ret < 0)
-				status->msg[0] = 0;
-			tray_update(hWnd, data);
+	odprintf("comms[resolve]: %u addresses", data->addrs_count);
+}
 
-			return 1;
-		}
+void comms_resolve_put(struct comms_resolve *req) {
+	if (InterlockedDecrement(&req->refs) != 0)
+		return;
 
-		data->addrs_cur = data->addrs_res;
-	}
+	odprintf("comms[resolve_put]: %p freed", req);
+
+	if (req->res != NULL)
+		freeaddrinfo(req->res);
+	free(req);
+}
+
+/* getaddrinfo can block for a long time, which must not happen on the thread
+ * that services the keyboard hook. The result is posted back to the window
+ * with the thread's reference to the request, unless it has been cancelled.
+ */
+DWORD WINAPI comms_resolve_thread(LPVOID param) {
+	struct comms_resolve *req = param;
+	BOOL ret;
+	DWORD err;
 
 	SetLastError(0);
-	ret = getnameinfo(data->addrs_cur->ai_addr, data->addrs_cur->ai_addrlen, data->hbuf, sizeof(data->hbuf), data->sbuf, sizeof(data->sbuf), NI_NUMERICHOST|NI_NUMERICSERV);
-	err = GetLastError();
-	odprintf("getnameinfo: %d (%ld)", ret, err);
-	if (ret == 0) {
-		odprintf("trying to connect to node \"%s\" service \"%s\"", data->hbuf, data->sbuf);
-	} else {
-		data->hbuf[0] = 0;
-		data->sbuf[0] = 0;
+	req->ret = getaddrinfo(req->node, req->service, &req->hints, &req->res);
+	req->err = GetLastError();
+	odprintf("getaddrinfo: %d (%ld)", req->ret, req->err);
+
+	if (!req->cancelled) {
+		SetLastError(0);
+		ret = PostMessage(req->hWnd, WM_APP_NET, (WPARAM)req, NET_MSG_RESOLVED);
+		err = GetLastError();
+		odprintf("PostMessage: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+		if (ret == TRUE)
+			return 0;
 	}
-#else
-	odprintf("trying to connect to node \"%s\" service \"%s\"", data->node, data->service);
-#endif
 
-	SetLastError(0);
-#if HAVE_GETADDRINFO
-	data->s = socket(data->addrs_cur->ai_family, SOCK_STREAM, IPPROTO_TCP);
-#else
-	data->s = socket(data->family, SOCK_STREAM, IPPROTO_TCP);
-#endif
-	err = GetLastError();
-	odprintf("socket: %d (%ld)", data->s, err);
+	comms_resolve_put(req);
+	return 0;
+}
 
-	if (data->s == INVALID_SOCKET) {
-		ret = snprintf(status->msg, sizeof(status->msg), "Unable to create socket (%ld)", err);
-		if (ret < 0)
-			status->msg[0] = 0;
-		tray_update(hWnd, data);
+int comms_resolve_start(HWND hWnd, struct slmpc_data *data) {
+	struct comms_resolve *req;
+	HANDLE thread;
+	DWORD err;
 
-#if HAVE_GETADDRINFO
-		data->addrs_cur = data->addrs_cur->ai_next;
-#endif
+	req = calloc(1, sizeof(*req));
+	if (req == NULL)
 		return 1;
-	}
+
+	/* one for us and one for the thread */
+	req->refs = 2;
+	req->hWnd = hWnd;
+	req->hints = data->hints;
+	snprintf(req->node, sizeof(req->node), "%s", data->node);
+	snprintf(req->service, sizeof(req->service), "%s", data->service);
 
 	SetLastError(0);
-	ret = setsockopt(data->s, SOL_SOCKET, SO_RCVTIMEO, (void*)&timeout, sizeof(timeout));
+	thread = CreateThread(NULL, 0, comms_resolve_thread, req, 0, NULL);
 	err = GetLastError();
-	odprintf("setsockopt: %d (%ld)", ret, err);
-	if (ret != 0) {
-		ret = snprintf(status->msg, sizeof(status->msg), "Unable to set socket timeout (%ld)", err);
-		if (ret < 0)
-			status->msg[0] = 0;
-		tray_update(hWnd, data);
+	odprintf("CreateThread: %p (%ld)", thread, err);
+	if (thread == NULL) {
+		free(req);
+		return 1;
+	}
 
-		SetLastError(0);
-		ret = closesocket(data->s);
-		err = GetLastError();
-		odprintf("closesocket: %d (%ld)", ret, err);
+	CloseHandle(thread);
+	data->resolving = req;
+	return 0;
+}
 
-		data->s = INVALID_SOCKET;
-		comms_timer_stop(hWnd);
-		data->cmd = MPC_NONE;
+/* Stop waiting for a resolve request; the thread can't be interrupted so it
+ * will free the request itself when getaddrinfo returns.
+ */
+void comms_resolve_cancel(struct slmpc_data *data) {
+	struct comms_resolve *req = data->resolving;
 
-#if HAVE_GETADDRINFO
-		data->addrs_cur = data->addrs_cur->ai_next;
-#endif
-		return 1;
+	if (req == NULL)
+		return;
+
+	odprintf("comms[resolve_cancel]: %p", req);
+
+	InterlockedExchange(&req->cancelled, 1);
+	data->resolving = NULL;
+	comms_resolve_put(req);
+}
+
+/* A result can be posted just before the request is cancelled, and once
+ * the message loop has finished it won't be received, so release any that
+ * are still queued. Nothing else on WM_APP_NET matters by then.
+ */
+void comms_resolve_drain(HWND hWnd) {
+	MSG msg;
+
+	while (PeekMessage(&msg, hWnd, WM_APP_NET, WM_APP_NET, PM_REMOVE)) {
+		if (msg.lParam != NET_MSG_RESOLVED)
+			continue;
+
+		odprintf("comms[resolve_drain]: %p", (void*)msg.wParam);
+		comms_resolve_put((struct comms_resolve*)msg.wParam);
 	}
+}
 
-	SetLastError(0);
-	ret = WSAIoctl(data->s, SIO_KEEPALIVE_VALS, (void*)&ka_set, sizeof(ka_set), (void*)&ka_get, sizeof(ka_get), &retd, NULL, NULL);
-	err = GetLastError();
-	odprintf("WSAIoctl: %d, %d (%ld)", ret, retd, err);
-	if (ret != 0) {
-		ret = snprintf(status->msg, sizeof(status->msg), "Unable to set socket keepalive options (%ld)", err);
-		if (ret < 0)
-			status->msg[0] = 0;
-		tray_update(hWnd, data);
+int comms_resolved(HWND hWnd, struct slmpc_data *data, struct comms_resolve *req) {
+	struct tray_status *status = &data->status;
+	INT ret;
 
-		SetLastError(0);
-		ret = closesocket(data->s);
-		err = GetLastError();
-		odprintf("closesocket: %d (%ld)", ret, err);
+	odprintf("comms[resolved]: %p ret=%d", req, req->ret);
 
-		data->s = INVALID_SOCKET;
-		comms_timer_stop(hWnd);
-		data->cmd = MPC_NONE;
+	if (req != data->resolving) {
+		odprintf("comms[resolved]: request cancelled");
+		comms_resolve_put(req);
+		return 0;
+	}
 
-#if HAVE_GETADDRINFO
-		data->addrs_cur = data->addrs_cur->ai_next;
-#endif
-		return 1;
+	data->resolving = NULL;
+	if (req->ret == 0)
+		comms_resolve_apply(data, req->res);
+
+	ret = req->ret;
+
+	/* the message's reference and ours */
+	comms_resolve_put(req);
+	comms_resolve_put(req);
+
+	/* keep using the old addresses until the next attempt to resolve */
+	if (ret != 0 && data->resolve_expired && data->addrs_count != 0) {
+		odprintf("comms[resolved]: using expired addresses (%d)", ret);
+		data->addrs_time = GetTickCount();
+		data->resolve_expired = 0;
+		return comms_connect(hWnd, data);
 	}
 
-	SetLastError(0);
-	ret = WSAAsyncSelect(data->s, hWnd, WM_APP_SOCK, FD_CONNECT|FD_READ|FD_CLOSE);
-	err = GetLastError();
-	odprintf("WSAAsyncSelect: %d (%ld)", ret, err);
 	if (ret != 0) {
-		ret = snprintf(status->msg, sizeof(status->msg), "Unable to async select on socket (%ld)", err);
+		status->conn = NOT_CONNECTED;
+		ret = snprintf(status->msg, sizeof(status->msg), "Unable to resolve node \"%s\" service \"%s\" (%d)", data->node, data->service, ret);
 		if (ret < 0)
 			status->msg[0] = 0;
 		tray_update(hWnd, data);
 
-		SetLastError(0);
-		ret = closesocket(data->s);
-		err = GetLastError();
-		odprintf("closesocket: %d (%ld)", ret, err);
+		return 1;
+	}
 
-		data->s = INVALID_SOCKET;
-		comms_timer_stop(hWnd);
-		data->cmd = MPC_NONE;
+	if (data->addrs_count == 0) {
+		status->conn = NOT_CONNECTED;
+		ret = snprintf(status->msg, sizeof(status->msg), "No results resolving node \"%s\" service \"%s\"", data->node, data->service);
+		if (ret < 0)
+			status->msg[0] = 0;
+		tray_update(hWnd, data);
 
-#if HAVE_GETADDRINFO
-		data->addrs_cur = data->addrs_cur->ai_next;
-#endif
 		return 1;
 	}
 
-	status->conn = CONNECTING;
-#if HAVE_GETADDRINFO
-	if (data->hbuf[0] != 0 && data->sbuf[0] != 0) {
-		ret = snprintf(status->msg, sizeof(status->msg), "node \"%s\" service \"%s\" (%ld)", data->hbuf, data->sbuf, err);
-	} else {
+	return comms_connect(hWnd, data);
+}
 #endif
-		ret = snprintf(status->msg, sizeof(status->msg), "node \"%s\" service \"%s\" (%ld)", data->node, data->service, err);
+
+void comms_addr_name(struct slmpc_data *data, const struct comms_addr *addr, char *hbuf, DWORD hlen, char *sbuf, DWORD slen) {
 #if HAVE_GETADDRINFO
-	}
-#endif
-	if (ret < 0)
-		status->msg[0] = 0;
-	tray_update(hWnd, data);
+	INT ret;
+	DWORD err;
 
 	SetLastError(0);
-#if HAVE_GETADDRINFO
-	ret = connect(data->s, data->addrs_cur->ai_addr, data->addrs_cur->ai_addrlen);
-#else
-	ret = connect(data->s, data->sa, data->sa_len);
-#endif
+	ret = getnameinfo((const struct sockaddr*)&addr->sa, addr->sa_len, hbuf, hlen, sbuf, slen, NI_NUMERICHOST|NI_NUMERICSERV);
 	err = GetLastError();
-	odprintf("connect: %d (%ld)", ret, err);
-	if (ret == 0 || err == WSAEWOULDBLOCK) {
-		return 0;
-	} else {
-		status->conn = NOT_CONNECTED;
-#if HAVE_GETADDRINFO
-		if (data->hbuf[0] != 0 && data->sbuf[0] != 0) {
-			ret = snprintf(status->msg, sizeof(status->msg), "Error connecting to node \"%s\" service \"%s\"", data->hbuf, data->sbuf);
-		} else {
-#endif
-			ret = snprintf(status->msg, sizeof(status->msg), "Error connecting to node \"%s\" service \"%s\"", data->node, data->service);
-#if HAVE_GETADDRINFO
-		}
+	odprintf("getnameinfo: %d (%ld)", ret, err);
+	if (ret == 0)
+		return;
+#else
+	(void)addr;
 #endif
-		if (ret < 0)
-			status->msg[0] = 0;
-		tray_update(hWnd, data);
 
-		SetLastError(0);
-		ret = closesocket(data->s);
-		err = GetLastError();
-		odprintf("closesocket: %d (%ld)", ret, err);
+	snprintf(hbuf, hlen, "%s", data->node);
+	snprintf(sbuf, slen, "%s", data->service);
+}
+
+/* Move the address that last connected to the front of the list so that it
+ * is tried first next time, the rest keep their order.
+ */
+void comms_addr_promote(struct slmpc_data *data, unsigned int addr) {
+	struct comms_addr tmp;
+
+	odprintf("comms[addr_promote]: %u", addr);
 
-		data->s = INVALID_SOCKET;
-		comms_timer_stop(hWnd);
-		data->cmd = MPC_NONE;
+	if (addr == 0 || addr >= data->addrs_count)
+		return;
+
+	tmp = data->addrs[addr];
+	memmove(&data->addrs[1], &data->addrs[0], addr * sizeof(data->addrs[0]));
+	data->addrs[0] = tmp;
+}
 
+/* Addresses may have changed along with the network, but keep the old ones
+ * in case they can't be resolved again yet.
+ */
+void comms_net_changed(struct slmpc_data *data) {
 #if HAVE_GETADDRINFO
-		data->addrs_cur = data->addrs_cur->ai_next;
+	odprintf("comms[net_changed]: addrs=%u", data->addrs_count);
+
+	if (data->addrs_count != 0)
+		data->resolve_expired = 1;
+#else
+	(void)data;
 #endif
-		return 1;
-	}
 }
 
-int comms_activity(HWND hWnd, struct slmpc_data *data, SOCKET s, WORD sEvent, WORD sError) {
+int comms_connect(HWND hWnd, struct slmpc_data *data) {
 	struct tray_status *status = &data->status;
 	INT ret;
-	DWORD err;
 
-	odprintf("comms[activity]: s=%p sEvent=%d sError=%d", s, sEvent, sError);
+	odprintf("comms[connect]");
 
 	if (!data->running)
 		return 0;
 
-	if (data->s != s)
+	if (data->conn.s != INVALID_SOCKET || data->attempts_count != 0)
 		return 0;
 
-	switch (sEvent) {
-	case FD_CONNECT:
-		odprintf("FD_CONNECT %s", status->conn == CONNECTING ? "OK" : "?");
-		if (status->conn != CONNECTING)
-			return 0;
-
-		if (sError == 0) {
-			status->conn = CONNECTED;
-			status->play = MPD_UNKNOWN;
-			data->cmd = MPC_CONNECT;
-			data->pending_cmd = MPC_NONE;
-			status->msg[0] = 0;
-			tray_update(hWnd, data);
-			comms_timer_start(hWnd);
-
-#if HAVE_GETADDRINFO
-			freeaddrinfo(data->addrs_res);
-			data->addrs_res = NULL;
-#endif
-			data->parse_pos = 0;
-			return 0;
-		} else {
-			status->conn = NOT_CONNECTED;
 #if HAVE_GETADDRINFO
-			if (data->hbuf[0] != 0 && data->sbuf[0] != 0) {
-				ret = snprintf(status->msg, sizeof(status->msg), "Error connecting to node \"%s\" service \"%s\" (%d)", data->hbuf, data->sbuf, sError);
-			} else {
+	if (data->resolving != NULL)
+		return 0;
 #endif
-				ret = snprintf(status->msg, sizeof(status->msg), "Error connecting to node \"%s\" service \"%s\" (%d)", data->node, data->service, sError);
+
+	status->conn = NOT_CONNECTED;
+	tray_update(hWnd, data);
+
 #if HAVE_GETADDRINFO
-			}
-#endif
+	/* addresses are kept between connections until they expire
+	 * or none of them work
+	 */
+	if (data->addrs_count != 0 && GetTickCount() - data->addrs_time >= data->opts.resolve_ttl * 1000) {
+		odprintf("comms[connect]: cached addresses expired");
+		data->resolve_expired = 1;
+	}
+
+	if (data->addrs_count == 0 || data->resolve_expired) {
+		ret = comms_resolve_start(hWnd, data);
+		if (ret != 0) {
+			ret = snprintf(status->msg, sizeof(status->msg), "Unable to start resolving node \"%s\" service \"%s\"", data->node, data->service);
 			if (ret < 0)
 				status->msg[0] = 0;
 			tray_update(hWnd, data);
 
-			SetLastError(0);
-			ret = closesocket(data->s);
-			err = GetLastError();
-			odprintf("closesocket: %d (%ld)", ret, err);
+			return 1;
+		}
 
-			data->s = INVALID_SOCKET;
-			comms_timer_stop(hWnd);
-			data->cmd = MPC_NONE;
+		/* continues in comms_resolved() */
+		status->conn = CONNECTING;
+		ret = snprintf(status->msg, sizeof(status->msg), "node \"%s\" service \"%s\" (resolving)", data->node, data->service);
+		if (ret < 0)
+			status->msg[0] = 0;
+		tray_update(hWnd, data);
 
-#if HAVE_GETADDRINFO
-			data->addrs_cur = data->addrs_cur->ai_next;
+		return 0;
+	}
 #endif
-			return 1;
-		}
 
-	case FD_READ:
-		odprintf("FD_READ %s", status->conn == CONNECTED ? "OK" : "?");
-		if (status->conn != CONNECTED)
-			return 0;
+	data->addrs_next = 0;
+	data->connect_start = GetTickCount();
 
-		if (sError == 0) {
-			char recv_buf[128];
+	ret = comms_attempt_next(hWnd, data);
+	if (ret != 0) {
+		tray_update(hWnd, data);
 
-			SetLastError(0);
-			ret = recv(data->s, recv_buf, sizeof(recv_buf), 0);
-			err = GetLastError();
-			odprintf("recv: %d (%ld)", ret, err);
-			if (ret <= 0) {
-				status->conn = NOT_CONNECTED;
 #if HAVE_GETADDRINFO
-				if (data->hbuf[0] != 0 && data->sbuf[0] != 0) {
-					ret = snprintf(status->msg, sizeof(status->msg), "Error reading from node \"%s\" service \"%s\" (%ld)", data->hbuf, data->sbuf, err);
-				} else {
+		data->addrs_count = 0;
 #endif
-					ret = snprintf(status->msg, sizeof(status->msg), "Error reading from node \"%s\" service \"%s\" (%ld)", data->node, data->service, err);
+		return 1;
+	}
+
+	status->conn = CONNECTING;
+	if (data->addrs_count > 1)
+		ret = snprintf(status->msg, sizeof(status->msg), "node \"%s\" service \"%s\" (%u addresses)", data->node, data->service, data->addrs_count);
+	else
+		ret = snprintf(status->msg, sizeof(status->msg), "node \"%s\" service \"%s\"", data->node, data->service);
+	if (ret < 0)
+		status->msg[0] = 0;
+	tray_update(hWnd, data);
+
+	comms_attempt_timer(hWnd, data);
+	return 0;
+}
+
+int comms_connect_timer(HWND hWnd, struct slmpc_data *data) {
+	INT ret;
+
+	odprintf("comms[connect_timer]");
+
+	if (!data->running || data->attempts_count == 0)
+		return 0;
+
+	ret = comms_attempt_next(hWnd, data);
+	if (ret != 0)
+		return 1;
+
+	comms_attempt_timer(hWnd, data);
+	return 0;
+}
+
+SOCKET comms_socket(HWND hWnd, int family, const char **fail, DWORD *err) {
+	struct tcp_keepalive ka_get;
+	struct tcp_keepalive ka_set = {
+		.onoff = 1,
+		.keepalivetime = 5000, /* 5 seconds */
+		.keepaliveinterval = 5000 /* 5 seconds */
+	};
+	int timeout = 5000; /* 5 seconds */
+	SOCKET s;
+	INT ret;
+	DWORD retd;
+
+	SetLastError(0);
+	s = socket(family, SOCK_STREAM, IPPROTO_TCP);
+	*err = GetLastError();
+	odprintf("socket: %d (%ld)", s, *err);
+
+	if (s == INVALID_SOCKET) {
+		*fail = "Unable to create socket";
+		return INVALID_SOCKET;
+	}
+
+	SetLastError(0);
+	ret = setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (void*)&timeout, sizeof(timeout));
+	*err = GetLastError();
+	odprintf("setsockopt: %d (%ld)", ret, *err);
+	if (ret != 0) {
+		*fail = "Unable to set socket timeout";
+		goto close_socket;
+	}
+
+	SetLastError(0);
+	ret = WSAIoctl(s, SIO_KEEPALIVE_VALS, (void*)&ka_set, sizeof(ka_set), (void*)&ka_get, sizeof(ka_get), &retd, NULL, NULL);
+	*err = GetLastError();
+	odprintf("WSAIoctl: %d, %d (%ld)", ret, retd, *err);
+	if (ret != 0) {
+		*fail = "Unable to set socket keepalive options";
+		goto close_socket;
+	}
+
+	SetLastError(0);
+	ret = WSAAsyncSelect(s, hWnd, WM_APP_SOCK, FD_CONNECT|FD_READ|FD_CLOSE);
+	*err = GetLastError();
+	odprintf("WSAAsyncSelect: %d (%ld)", ret, *err);
+	if (ret != 0) {
+		*fail = "Unable to async select on socket";
+		goto close_socket;
+	}
+
+	return s;
+
+close_socket:
+	SetLastError(0);
+	ret = closesocket(s);
+	retd = GetLastError();
+	odprintf("closesocket: %d (%ld)", ret, retd);
+	return INVALID_SOCKET;
+}
+
+int comms_attempt_start(HWND hWnd, struct slmpc_data *data, unsigned int addr) {
+	struct tray_status *status = &data->status;
+	struct comms_addr *target = &data->addrs[addr];
+	struct comms_attempt *attempt;
+	const char *fail;
+	char hbuf[NI_MAXHOST];
+	char sbuf[NI_MAXSERV];
+	SOCKET s;
+	INT ret;
+	DWORD err;
+
+	comms_addr_name(data, target, hbuf, sizeof(hbuf), sbuf, sizeof(sbuf));
+	odprintf("trying to connect to node \"%s\" service \"%s\" (%s)", hbuf, sbuf, comms_family_name(target->family));
+
+	data->connect_stats[comms_family_index(target->family)].attempts++;
+
+	s = comms_socket(hWnd, target->family, &fail, &err);
+	if (s == INVALID_SOCKET) {
+		ret = snprintf(status->msg, sizeof(status->msg), "%s (%ld)", fail, err);
+		if (ret < 0)
+			status->msg[0] = 0;
+		return 1;
+	}
+
+	attempt = &data->attempts[data->attempts_count++];
+	attempt->s = s;
+	attempt->addr = addr;
+	attempt->start = GetTickCount();
+
+	SetLastError(0);
+	ret = connect(s, (const struct sockaddr*)&target->sa, target->sa_len);
+	err = GetLastError();
+	odprintf("connect: %d (%ld)", ret, err);
+	if (ret == 0 || err == WSAEWOULDBLOCK)
+		return 0;
+
+	ret = snprintf(status->msg, sizeof(status->msg), "Error connecting to node \"%s\" service \"%s\" (%ld)", hbuf, sbuf, err);
+	if (ret < 0)
+		status->msg[0] = 0;
+
+	comms_attempt_close(data, data->attempts_count - 1);
+	return 1;
+}
+
+/* Start connecting to the next address(es), returns non-zero only when there
+ * are no attempts in progress and no addresses left to try.
+ */
+int comms_attempt_next(HWND hWnd, struct slmpc_data *data) {
+	while (data->addrs_next < data->addrs_count) {
+		if (data->attempts_count >= COMMS_MAX_ATTEMPTS)
+			return 0;
+
+		if (comms_attempt_start(hWnd, data, data->addrs_next++) == 0)
+			return 0;
+	}
+
+	return data->attempts_count == 0 ? 1 : 0;
+}
+
+void comms_attempt_close(struct slmpc_data *data, unsigned int i) {
+	INT ret;
+	DWORD err;
+
+	odprintf("comms[attempt_close]: %u", i);
+
+	SetLastError(0);
+	ret = closesocket(data->attempts[i].s);
+	err = GetLastError();
+	odprintf("closesocket: %d (%ld)", ret, err);
+
+	data->attempts[i] = data->attempts[--data->attempts_count];
+}
+
+void comms_attempt_abort(HWND hWnd, struct slmpc_data *data) {
+	while (data->attempts_count > 0)
+		comms_attempt_close(data, data->attempts_count - 1);
+
+	comms_timer_kill(hWnd, CONNECT_TIMER_ID);
+}
+
+void comms_attempt_timer(HWND hWnd, struct slmpc_data *data) {
+	if (data->addrs_next < data->addrs_count)
+		comms_timer_set(hWnd, CONNECT_TIMER_ID, CONNECT_STAGGER);
+}
+
+int comms_attempt_activity(HWND hWnd, struct slmpc_data *data, unsigned int i, WORD sEvent, WORD sError) {
+	struct tray_status *status = &data->status;
+	struct comms_attempt *attempt = &data->attempts[i];
+	struct comms_addr *target = &data->addrs[attempt->addr];
+	struct comms_family_stats *stats = &data->connect_stats[comms_family_index(target->family)];
+	DWORD now = GetTickCount();
+	char hbuf[NI_MAXHOST];
+	char sbuf[NI_MAXSERV];
+	INT ret;
+
+	odprintf("comms[attempt_activity]: %u sEvent=%d sError=%d", i, sEvent, sError);
+
+	if (sEvent != FD_CONNECT)
+		return 0;
+
+	if (sError == 0) {
+		DWORD elapsed = now - data->connect_start;
+
+		odprintf("FD_CONNECT OK (%s) after %lums, %lums since attempt started", comms_family_name(target->family), elapsed, now - attempt->start);
+
+		stats->connects++;
+		stats->last = elapsed;
+		stats->total += elapsed;
+		if (stats->connects == 1 || elapsed < stats->min)
+			stats->min = elapsed;
+		if (elapsed > stats->max)
+			stats->max = elapsed;
+		comms_connect_report(data);
+
+		/* keep the winner, close the rest */
+		data->conn.s = attempt->s;
+		data->conn_addr = *target;
+		data->attempts[i] = data->attempts[--data->attempts_count];
+		comms_attempt_abort(hWnd, data);
+
 #if HAVE_GETADDRINFO
-				}
+		comms_addr_name(data, target, data->hbuf, sizeof(data->hbuf), data->sbuf, sizeof(data->sbuf));
 #endif
-				if (ret < 0)
-					status->msg[0] = 0;
-				tray_update(hWnd, data);
+		comms_addr_promote(data, target - data->addrs);
 
-				SetLastError(0);
-				ret = closesocket(data->s);
-				err = GetLastError();
-				odprintf("closesocket: %d (%ld)", ret, err);
+		status->conn = CONNECTED;
+		status->play = MPD_UNKNOWN;
+		status->pending = MPD_UNKNOWN;
+		status->rejected = 0;
+		status->msg[0] = 0;
+		tray_update(hWnd, data);
 
-				data->s = INVALID_SOCKET;
-				comms_timer_stop(hWnd);
-				data->cmd = MPC_NONE;
-				return 1;
-			} else if (err == WSAEWOULDBLOCK) {
-				return 0;
-			} else {
-				int size, i;
+		/* the whole session setup is sent at once,
+		 * without waiting for the greeting first
+		 */
+		comms_reset(&data->conn);
+		comms_queue(&data->conn, MPC_CONNECT, "");
+		if (data->password[0] != 0) {
+			comms_list_begin(&data->conn);
+			comms_queue(&data->conn, MPC_PASSWORD, "password %s\n", data->password);
+			comms_queue(&data->conn, MPC_STATUS, "status\n");
+			comms_queue(&data->conn, MPC_SONG, "currentsong\n");
+			comms_list_end(&data->conn);
+		} else {
+			comms_queue(&data->conn, MPC_STATUS, "status\n");
+			comms_queue(&data->conn, MPC_SONG, "currentsong\n");
+		}
+		comms_queue_idle(&data->conn);
+
+		ret = comms_flush(hWnd, &data->conn);
+		if (ret) {
+			status->conn = NOT_CONNECTED;
+
+			ret = snprintf(status->msg, sizeof(status->msg), "Error starting session (%d)", ret);
+			if (ret < 0)
+				status->msg[0] = 0;
+			tray_update(hWnd, data);
+
+			comms_close(hWnd, data);
+			return 1;
+		}
+
+		if (data->opts.ctl_conn) {
+			comms_ctl_connect(hWnd, data);
+			comms_timer_set(hWnd, CTL_PING_TIMER_ID, CTL_PING_INTERVAL);
+		}
+
+		data->hb_outstanding = 0;
+		data->hb_misses = 0;
+		if (data->opts.hb_interval != 0)
+			comms_timer_set(hWnd, HEARTBEAT_TIMER_ID, data->opts.hb_interval);
+		return 0;
+	}
 
-				size = ret;
-				for (i = 0; i < size; i++) {
-					/* find a newline and parse the buffer */
-					if (recv_buf[i] == '\n') {
-						ret = comms_parse(hWnd, data);
+	comms_addr_name(data, target, hbuf, sizeof(hbuf), sbuf, sizeof(sbuf));
+	odprintf("FD_CONNECT failed (%s) after %lums", comms_family_name(target->family), now - attempt->start);
+
+	ret = snprintf(status->msg, sizeof(status->msg), "Error connecting to node \"%s\" service \"%s\" (%d)", hbuf, sbuf, sError);
+	if (ret < 0)
+		status->msg[0] = 0;
 
-						/* clear buffer */
-						data->parse_pos = 0;
+	comms_attempt_close(data, i);
 
-						if (ret < 0)
-							status->conn = NOT_CONNECTED;
+	/* don't wait for the stagger interval to try the next address */
+	ret = comms_attempt_next(hWnd, data);
+	if (ret != 0) {
+		status->conn = NOT_CONNECTED;
+		tray_update(hWnd, data);
+		comms_attempt_abort(hWnd, data);
 
-						if (ret != 0)
-							tray_update(hWnd, data);
+#if HAVE_GETADDRINFO
+		data->addrs_count = 0;
+#endif
+		return 1;
+	}
 
-						if (ret < 0) {
-							SetLastError(0);
-							ret = closesocket(data->s);
-							err = GetLastError();
-							odprintf("closesocket: %d (%ld)", ret, err);
+	comms_attempt_timer(hWnd, data);
+	return 0;
+}
 
-							data->s = INVALID_SOCKET;
-							comms_timer_stop(hWnd);
-							data->cmd = MPC_NONE;
-							return 1;
-						}
+void comms_connect_report(struct slmpc_data *data) {
+	unsigned int i;
 
-					/* buffer overflow */
-					} else if (data->parse_pos == sizeof(data->parse_buf)/sizeof(char) - 1) {
-						odprintf("parse: sender overflowed buffer waiting for '\\n'");
-						data->parse_buf[0] = 0;
-						data->parse_pos++;
+	for (i = 0; i < sizeof(data->connect_stats)/sizeof(data->connect_stats[0]); i++) {
+		struct comms_family_stats *stats = &data->connect_stats[i];
 
-					/* ignore */
-					} else if (data->parse_pos > sizeof(data->parse_buf)/sizeof(char) - 1) {
+		if (stats->connects == 0) {
+			odprintf("comms[stats]: %s attempts=%u connects=0", i == 1 ? "IPv6" : "IPv4", stats->attempts);
+		} else {
+			odprintf("comms[stats]: %s attempts=%u connects=%u time-to-connect last=%lums min=%lums avg=%lums max=%lums",
+				i == 1 ? "IPv6" : "IPv4", stats->attempts, stats->connects,
+				stats->last, stats->min, stats->total / stats->connects, stats->max);
+		}
+	}
+}
 
-					/* append to buffer */
-					} else {
-						data->parse_buf[data->parse_pos++] = recv_buf[i];
-						data->parse_buf[data->parse_pos] = 0;
-					}
+int comms_activity(HWND hWnd, struct slmpc_data *data, SOCKET s, WORD sEvent, WORD sError) {
+	struct tray_status *status = &data->status;
+	unsigned int attempt;
+	INT ret;
+	DWORD err;
+
+	odprintf("comms[activity]: s=%p sEvent=%d sError=%d", s, sEvent, sError);
+
+	if (!data->running)
+		return 0;
+
+	for (attempt = 0; attempt < data->attempts_count; attempt++)
+		if (data->attempts[attempt].s == s)
+			return comms_attempt_activity(hWnd, data, attempt, sEvent, sError);
+
+	if (data->ctl.s == s && s != INVALID_SOCKET)
+		return comms_ctl_activity(hWnd, data, sEvent, sError);
+
+	if (data->conn.s != s)
+		return 0;
+
+	switch (sEvent) {
+	case FD_READ:
+		odprintf("FD_READ %s", status->conn == CONNECTED ? "OK" : "?");
+		if (status->conn != CONNECTED)
+			return 0;
+
+		if (sError == 0) {
+			ret = comms_read(hWnd, data, &data->conn, &err);
+			if (ret == -1) {
+				status->conn = NOT_CONNECTED;
+#if HAVE_GETADDRINFO
+				if (data->hbuf[0] != 0 && data->sbuf[0] != 0) {
+					ret = snprintf(status->msg, sizeof(status->msg), "Error reading from node \"%s\" service \"%s\" (%ld)", data->hbuf, data->sbuf, err);
+				} else {
+#endif
+					ret = snprintf(status->msg, sizeof(status->msg), "Error reading from node \"%s\" service \"%s\" (%ld)", data->node, data->service, err);
+#if HAVE_GETADDRINFO
 				}
-				return 0;
+#endif
+				if (ret < 0)
+					status->msg[0] = 0;
+				tray_update(hWnd, data);
+
+				comms_close(hWnd, data);
+				return 1;
+			} else if (ret < 0) {
+				status->conn = NOT_CONNECTED;
+				tray_update(hWnd, data);
+
+				comms_close(hWnd, data);
+				return 1;
+			} else if (ret > 0) {
+				tray_update(hWnd, data);
 			}
+			return 0;
 		} else {
 			status->conn = NOT_CONNECTED;
 #if HAVE_GETADDRINFO
@@ -537,14 +946,7 @@ int comms_activity(HWND hWnd, struct slmpc_data *data, SOCKET s, WORD sEvent, WO
 				status->msg[0] = 0;
 			tray_update(hWnd, data);
 
-			SetLastError(0);
-			ret = closesocket(data->s);
-			err = GetLastError();
-			odprintf("closesocket: %d (%ld)", ret, err);
-
-			data->s = INVALID_SOCKET;
-			comms_timer_stop(hWnd);
-			data->cmd = MPC_NONE;
+			comms_close(hWnd, data);
 			return 1;
 		}
 
@@ -567,9 +969,7 @@ int comms_activity(HWND hWnd, struct slmpc_data *data, SOCKET s, WORD sEvent, WO
 			status->msg[0] = 0;
 		tray_update(hWnd, data);
 
-		data->s = INVALID_SOCKET;
-		comms_timer_stop(hWnd);
-		data->cmd = MPC_NONE;
+		comms_close(hWnd, data);
 		return 1;
 
 	default:
@@ -577,10 +977,9 @@ int comms_activity(HWND hWnd, struct slmpc_data *data, SOCKET s, WORD sEvent, WO
 	}
 }
 
-int comms_send(SOCKET s, const char *data) {
+int comms_send(SOCKET s, const char *data, int len) {
 	INT ret;
 	DWORD err;
-	int len = strlen(data);
 
 	SetLastError(0);
 	ret = send(s, data, len, 0);
@@ -594,231 +993,1066 @@ int comms_send(SOCKET s, const char *data) {
 	return 0;
 }
 
-int comms_parse(HWND hWnd, struct slmpc_data *data) {
-	struct tray_status *status = &data->status;
-	char msg_type[64];
+void comms_reset(struct comms_conn *conn) {
+	conn->cmd = MPC_NONE;
+	conn->inflight_head = 0;
+	conn->inflight_count = 0;
+	conn->send_len = 0;
+	conn->send_list = 0;
+	conn->send_err = 0;
+	conn->recv_start = 0;
+	conn->recv_len = 0;
+	conn->recv_discard = 0;
+	conn->last_response = 0;
+}
+
+/* The round trip time is kept when reconnecting to the same server */
+void comms_rtt_reset(struct comms_conn *conn) {
+	conn->rtt_sampled = 0;
+	conn->srtt = 0;
+	conn->rttvar = 0;
+	conn->rto = RTO_INITIAL;
+}
+
+/* Append a command to the connection's send buffer, and if it has a response
+ * (cmd is not MPC_NONE) then also to the list of commands waiting for one.
+ * Nothing is sent until comms_flush() is called.
+ */
+void comms_queue(struct comms_conn *conn, enum cmd_status cmd, const char *fmt, ...) {
+	unsigned int avail = sizeof(conn->send_buf) - conn->send_len;
+	va_list args;
 	int ret;
-	(void)hWnd;
-	(void)status;
 
-	odprintf("comms[parse]: \"%s\"", data->parse_buf);
+	va_start(args, fmt);
+	ret = vsnprintf(conn->send_buf + conn->send_len, avail, fmt, args);
+	va_end(args);
 
-	if (sscanf(data->parse_buf, "%64s", msg_type) == 1) {
-		if (!strcmp(msg_type, "OK")) {
-			comms_timer_stop(hWnd);
+	if (ret < 0 || (unsigned int)ret >= avail) {
+		odprintf("comms[queue]: send buffer full");
+		conn->send_err = 1;
+		return;
+	}
+	conn->send_len += ret;
 
-			switch (data->cmd) {	
-			case MPC_NONE:
-				odprintf("comms[parse]: no command running?");
-				ret = snprintf(status->msg, sizeof(status->msg), "Internal error, got OK response but no command was running");
-				if (ret < 0)
-					status->msg[0] = 0;
-				return -1;
+	if (cmd == MPC_NONE)
+		return;
 
-			case MPC_CONNECT:
-				if (data->password[0] != 0) {
-					odprintf("comms[parse]: connected, sending password");
-
-					ret = comms_send(data->s, "password ");
-					ret |= comms_send(data->s, data->password);
-					ret |= comms_send(data->s, "\n");
-					if (ret) {
-						ret = snprintf(status->msg, sizeof(status->msg), "Error sending password (%d)", ret);
-						if (ret < 0)
-							status->msg[0] = 0;
-						return -1;
-					}
+	if (conn->inflight_count == COMMS_MAX_INFLIGHT) {
+		odprintf("comms[queue]: too many commands waiting for a response");
+		conn->send_err = 1;
+		return;
+	}
 
-					data->cmd = MPC_PASSWORD;
-					comms_timer_start(hWnd);
-					break;
-				}
-				odprintf("comms[parse]: connected, requesting status");
+	conn->inflight[(conn->inflight_head + conn->inflight_count) % COMMS_MAX_INFLIGHT].cmd = cmd;
+	conn->inflight[(conn->inflight_head + conn->inflight_count) % COMMS_MAX_INFLIGHT].list = conn->send_list;
+	conn->inflight[(conn->inflight_head + conn->inflight_count) % COMMS_MAX_INFLIGHT].sent = GetTickCount();
+	conn->inflight_count++;
 
-			case MPC_PASSWORD:
-				if (data->cmd == MPC_PASSWORD)
-					odprintf("comms[parse]: authenticated, requesting status");
-
-				ret = comms_send(data->s, "status\n");
-				if (ret) {
-					ret = snprintf(status->msg, sizeof(status->msg), "Error requesting status (%d)", ret);
-					if (ret < 0)
-						status->msg[0] = 0;
-					return -1;
-				}
+	if (conn->inflight_count == 1)
+		conn->cmd = cmd;
+}
 
-				data->cmd = MPC_STATUS;
-				comms_timer_start(hWnd);
-				break;
+void comms_list_begin(struct comms_conn *conn) {
+	comms_queue(conn, MPC_NONE, "command_list_ok_begin\n");
+	conn->send_list = 1;
+}
 
-			case MPC_STATUS:
-				odprintf("comms[parse]: status received, going idle");
-
-				if (data->pending_cmd != MPC_NONE) {
-					ret = comms_send(data->s, "idle player\n");
-					if (ret) {
-						ret = snprintf(status->msg, sizeof(status->msg), "Error requesting idle mode (%d)", ret);
-						if (ret < 0)
-							status->msg[0] = 0;
-						return -1;
-					}
+void comms_list_end(struct comms_conn *conn) {
+	conn->send_list = 0;
+	comms_queue(conn, MPC_LIST, "command_list_end\n");
+}
 
-					data->cmd = MPC_IDLE;
-					break;
-				}
+/* Queue a play/pause command with a status request to confirm it */
+void comms_queue_play(struct comms_conn *conn, enum cmd_status cmd) {
+	comms_list_begin(conn);
+	if (cmd == MPC_PLAY)
+		comms_queue(conn, MPC_PLAY, "play -1\n");
+	else
+		comms_queue(conn, MPC_PAUSE, "pause 1\n");
+	comms_queue(conn, MPC_STATUS, "status\n");
+	comms_list_end(conn);
+}
 
-			case MPC_IDLE:
-			case MPC_NOIDLE:
-				odprintf("comms[parse]: resume from idle");
-
-				switch (data->pending_cmd) {
-				case MPC_NONE:
-					odprintf("comms[parse]: no command pending, going idle");
-
-					ret = comms_send(data->s, "idle player\n");
-					if (ret) {
-						ret = snprintf(status->msg, sizeof(status->msg), "Error requesting idle mode (%d)", ret);
-						if (ret < 0)
-							status->msg[0] = 0;
-						return -1;
-					}
+/* Queue all of the key binding requests waiting to be sent, as one command list.
+ * Requests of the same type have already been merged together.
+ */
+void comms_queue_keys(struct comms_conn *conn, struct slmpc_data *data) {
+	int i;
+
+	odprintf("comms[queue_keys]: skip=%d seek=%d volume=%d stop=%d", data->key_skip, data->key_seek, data->key_volume, data->key_stop);
+
+	comms_list_begin(conn);
+	for (i = 0; i < data->key_skip; i++)
+		comms_queue(conn, MPC_SKIP, "next\n");
+	for (i = 0; i > data->key_skip; i--)
+		comms_queue(conn, MPC_SKIP, "previous\n");
+	if (data->key_seek != 0)
+		comms_queue(conn, MPC_SEEK, "seekcur %+d\n", data->key_seek);
+	if (data->key_volume != 0)
+		comms_queue(conn, MPC_VOLUME, "volume %+d\n", data->key_volume);
+	if (data->key_stop)
+		comms_queue(conn, MPC_STOP, "stop\n");
+	comms_queue(conn, MPC_STATUS, "status\n");
+	/* the song will have changed, so save a round trip */
+	if (data->key_skip != 0)
+		comms_queue(conn, MPC_SONG, "currentsong\n");
+	comms_list_end(conn);
+
+	comms_keys_reset(data);
+}
 
-					data->cmd = MPC_IDLE;
-					break;
-
-				case MPC_CONNECT:
-				case MPC_PASSWORD:
-				case MPC_IDLE:
-				case MPC_NOIDLE:
-					odprintf("comms[parse]: pending connect/password/idle?");
-					ret = snprintf(status->msg, sizeof(status->msg), "Internal error, got OK response to idle but invalid command was pending");
-					if (ret < 0)
-						status->msg[0] = 0;
-					return -1;
+void comms_keys_reset(struct slmpc_data *data) {
+	data->key_skip = 0;
+	data->key_seek = 0;
+	data->key_volume = 0;
+	data->key_stop = 0;
+}
 
-				case MPC_STATUS:
-					odprintf("comms[parse]: pending command to request status");
+int comms_keys_pending(struct slmpc_data *data) {
+	return data->key_skip != 0 || data->key_seek != 0 || data->key_volume != 0 || data->key_stop;
+}
 
-					ret = comms_send(data->s, "status\n");
-					if (ret) {
-						ret = snprintf(status->msg, sizeof(status->msg), "Error requesting status (%d)", ret);
-						if (ret < 0)
-							status->msg[0] = 0;
-						return -1;
-					}
+int comms_keys_inflight(struct comms_conn *conn) {
+	return comms_inflight(conn, MPC_SKIP) || comms_inflight(conn, MPC_SEEK)
+		|| comms_inflight(conn, MPC_VOLUME) || comms_inflight(conn, MPC_STOP);
+}
 
-					data->cmd = MPC_STATUS;
-					comms_timer_start(hWnd);
-					break;
+/* If the last command queued is idle, cancel it so that more commands can be
+ * pipelined after it, returns non-zero if it was.
+ */
+int comms_idle_tail(struct comms_conn *conn) {
+	if (conn->inflight_count == 0)
+		return 0;
 
-				case MPC_PLAY:
-					odprintf("comms[parse]: pending command to play");
+	return conn->inflight[(conn->inflight_head + conn->inflight_count - 1) % COMMS_MAX_INFLIGHT].cmd == MPC_IDLE;
+}
 
-					ret = comms_send(data->s, "play -1\n");
-					if (ret) {
-						ret = snprintf(status->msg, sizeof(status->msg), "Error sending play command (%d)", ret);
-						if (ret < 0)
-							status->msg[0] = 0;
-						return -1;
-					}
+int comms_noidle(struct comms_conn *conn) {
+	struct comms_cmd *tail;
 
-					data->cmd = MPC_PLAY;
-					comms_timer_start(hWnd);
-					break;
+	if (!comms_idle_tail(conn))
+		return 0;
 
-				case MPC_PAUSE:
-					odprintf("comms[parse]: pending command to pause");
+	tail = &conn->inflight[(conn->inflight_head + conn->inflight_count - 1) % COMMS_MAX_INFLIGHT];
 
-					ret = comms_send(data->s, "pause 1\n");
-					if (ret) {
-						ret = snprintf(status->msg, sizeof(status->msg), "Error sending pause command (%d)", ret);
-						if (ret < 0)
-							status->msg[0] = 0;
-						return -1;
-					}
+	/* the response is only due once noidle has been sent */
+	tail->cmd = MPC_NOIDLE;
+	tail->sent = GetTickCount();
+	if (conn->inflight_count == 1)
+		conn->cmd = MPC_NOIDLE;
 
-					data->cmd = MPC_PAUSE;
-					comms_timer_start(hWnd);
-					break;
-				}
+	comms_queue(conn, MPC_NONE, "noidle\n");
+	return 1;
+}
 
-				data->pending_cmd = MPC_NONE;
-				break;
+int comms_inflight(struct comms_conn *conn, enum cmd_status cmd) {
+	unsigned int i;
 
-			case MPC_PLAY:
-			case MPC_PAUSE:
-				odprintf("comms[parse]: finished play/pause, requesting status");
+	for (i = 0; i < conn->inflight_count; i++)
+		if (conn->inflight[(conn->inflight_head + i) % COMMS_MAX_INFLIGHT].cmd == cmd)
+			return 1;
+	return 0;
+}
 
-				ret = comms_send(data->s, "status\n");
-				if (ret) {
-					ret = snprintf(status->msg, sizeof(status->msg), "Error requesting status (%d)", ret);
-					if (ret < 0)
-						status->msg[0] = 0;
-					return -1;
-				}
+struct comms_cmd comms_pop(struct comms_conn *conn) {
+	struct comms_cmd entry = conn->inflight[conn->inflight_head];
 
-				data->cmd = MPC_STATUS;
-				comms_timer_start(hWnd);
-				break;
-			}
-		} else if (!strcmp(msg_type, "ACK")) {
-			comms_timer_stop(hWnd);
+	conn->inflight_head = (conn->inflight_head + 1) % COMMS_MAX_INFLIGHT;
+	conn->inflight_count--;
 
-			switch (data->cmd) {
-			case MPC_NONE:
-				odprintf("comms[parse]: no command running?");
-				ret = snprintf(status->msg, sizeof(status->msg), "Internal error, got ACK response but no command was running");
-				if (ret < 0)
-					status->msg[0] = 0;
-				return -1;
+	if (conn->inflight_count == 0)
+		conn->cmd = MPC_NONE;
+	else
+		conn->cmd = conn->inflight[conn->inflight_head].cmd;
 
-			case MPC_CONNECT:
-				ret = snprintf(status->msg, sizeof(status->msg), "Session start failed (%s)", data->parse_buf);
-				if (ret < 0)
-					status->msg[0] = 0;
-				return -1;
+	return entry;
+}
 
-			case MPC_PASSWORD:
-				ret = snprintf(status->msg, sizeof(status->msg), "Authentication failed (%s)", data->parse_buf);
-				if (ret < 0)
-					status->msg[0] = 0;
-				return -1;
+/* Estimate the round trip time from each response in the same way as TCP
+ * (RFC 6298). With pipelining a command can't be answered until the one
+ * before it has been, so it is timed from whichever happened later.
+ */
+void comms_rtt_update(struct comms_conn *conn, const struct comms_cmd *entry) {
+	DWORD now = GetTickCount();
+	DWORD start, sample, delta;
+
+	start = entry->sent;
+	if (conn->last_response != 0 && (LONG)(conn->last_response - start) > 0)
+		start = conn->last_response;
+	conn->last_response = now;
+
+	/* there's no limit on how long idle can take, and commands that make
+	 * the server start or stop playback measure its outputs, not the network
+	 */
+	if (entry->cmd == MPC_IDLE || comms_rtt_work(entry->cmd))
+		return;
 
-			case MPC_STATUS:
-				ret = snprintf(status->msg, sizeof(status->msg), "Status request failed (%s)", data->parse_buf);
-				if (ret < 0)
-					status->msg[0] = 0;
-				return -1;
+	sample = now - start;
+	if (!conn->rtt_sampled) {
+		conn->rtt_sampled = 1;
+		conn->srtt = sample;
+		conn->rttvar = sample / 2;
+	} else {
+		delta = sample > conn->srtt ? sample - conn->srtt : conn->srtt - sample;
+		conn->rttvar = (3 * conn->rttvar + delta) / 4;
+		conn->srtt = (7 * conn->srtt + sample) / 8;
+	}
 
-			case MPC_IDLE:
-				ret = snprintf(status->msg, sizeof(status->msg), "Idle command failed (%s)", data->parse_buf);
-				if (ret < 0)
-					status->msg[0] = 0;
-				return -1;
+	conn->rto = conn->srtt + (4 * conn->rttvar > RTO_GRANULARITY ? 4 * conn->rttvar : RTO_GRANULARITY);
+	if (conn->rto < RTO_MIN)
+		conn->rto = RTO_MIN;
+	if (conn->rto > RTO_MAX)
+		conn->rto = RTO_MAX;
 
-			case MPC_NOIDLE:
-				ret = snprintf(status->msg, sizeof(status->msg), "Idle abort failed (%s)", data->parse_buf);
-				if (ret < 0)
-					status->msg[0] = 0;
-				return -1;
+	odprintf("comms[rtt]: cmd=%d sample=%lu srtt=%lu rttvar=%lu rto=%lu", entry->cmd, sample, conn->srtt, conn->rttvar, conn->rto);
+}
 
-			case MPC_PLAY:
-				ret = snprintf(status->msg, sizeof(status->msg), "Play command failed (%s)", data->parse_buf);
-				if (ret < 0)
-					status->msg[0] = 0;
+/* Commands that do work on the server (opening the decoder and outputs)
+ * before they're answered
+ */
+int comms_rtt_work(enum cmd_status cmd) {
+	switch (cmd) {
+	case MPC_PLAY:
+	case MPC_PAUSE:
+	case MPC_SKIP:
+	case MPC_SEEK:
+	case MPC_STOP:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+DWORD comms_rtt_timeout(const struct comms_conn *conn, enum cmd_status cmd) {
+	if (comms_rtt_work(cmd) && conn->rto < RTO_WORK_MIN)
+		return RTO_WORK_MIN;
+	return conn->rto;
+}
+
+void comms_rtt_backoff(struct comms_conn *conn) {
+	conn->rto *= 2;
+	if (conn->rto > RTO_MAX)
+		conn->rto = RTO_MAX;
+
+	odprintf("comms[rtt]: backoff rto=%lu", conn->rto);
+}
+
+/* Send everything that has been queued in one write */
+int comms_flush(HWND hWnd, struct comms_conn *conn) {
+	int ret;
+
+	odprintf("comms[flush]: %u bytes, %u waiting", conn->send_len, conn->inflight_count);
+
+	if (conn->send_err)
+		ret = -1;
+	else if (conn->send_len > 0)
+		ret = comms_send(conn->s, conn->send_buf, conn->send_len);
+	else
+		ret = 0;
+
+	conn->send_len = 0;
+	conn->send_list = 0;
+	conn->send_err = 0;
+
+	comms_timer_update(hWnd, conn);
+	return ret;
+}
+
+void comms_close(HWND hWnd, struct slmpc_data *data) {
+	INT ret;
+	DWORD err;
+
+	odprintf("comms[close]");
+
+	comms_ctl_close(hWnd, data);
+	comms_timer_kill(hWnd, CTL_PING_TIMER_ID);
+	comms_timer_kill(hWnd, HEARTBEAT_TIMER_ID);
+
+	/* a press waiting to be sent is replayed after reconnecting instead */
+	comms_timer_kill(hWnd, DEBOUNCE_TIMER_ID);
+	data->kbd_window = 0;
+	if (data->kbd_pending) {
+		data->kbd_pending = 0;
+		data->replay = 1;
+	}
+
+	if (data->conn.s != INVALID_SOCKET) {
+		SetLastError(0);
+		ret = closesocket(data->conn.s);
+		err = GetLastError();
+		odprintf("closesocket: %d (%ld)", ret, err);
+
+		data->conn.s = INVALID_SOCKET;
+	}
+
+	comms_reset(&data->conn);
+	comms_recv_free(&data->conn);
+	comms_timer_update(hWnd, &data->conn);
+
+	/* anything important is replayed after reconnecting */
+	data->queue_count = 0;
+	comms_keys_reset(data);
+}
+
+/* Make space for more data at the end of the receive buffer, returns
+ * non-zero if the buffer is already as large as it is allowed to be.
+ */
+int comms_recv_grow(struct comms_conn *conn) {
+	unsigned int size;
+	char *buf;
+
+	if (conn->recv_start > 0) {
+		/* move the incomplete line back to the start */
+		memmove(conn->recv_buf, conn->recv_buf + conn->recv_start, conn->recv_len);
+		conn->recv_start = 0;
+		return 0;
+	}
+
+	if (conn->recv_buf == NULL)
+		size = RECV_BUF_MIN;
+	else if (conn->recv_size < RECV_BUF_MAX)
+		size = conn->recv_size << 1;
+	else
+		return 1;
+
+	buf = realloc(conn->recv_buf, size);
+	odprintf("comms[recv_grow]: %u -> %u (%p)", conn->recv_size, size, buf);
+	if (buf == NULL)
+		return 1;
+
+	conn->recv_buf = buf;
+	conn->recv_size = size;
+	return 0;
+}
+
+void comms_recv_free(struct comms_conn *conn) {
+	free(conn->recv_buf);
+	conn->recv_buf = NULL;
+	conn->recv_size = 0;
+	conn->recv_start = 0;
+	conn->recv_len = 0;
+}
+
+/* Read everything available from a connection and parse any complete lines
+ * in place. Returns -1 if the read failed (with err set), -2 if a response
+ * could not be handled, 1 if the tray status has changed and 0 otherwise.
+ */
+int comms_read(HWND hWnd, struct slmpc_data *data, struct comms_conn *conn, DWORD *err) {
+	char *line, *end;
+	unsigned int len, scan;
+	int changed = 0;
+	INT ret;
+
+	while (1) {
+		if (conn->recv_start + conn->recv_len == conn->recv_size) {
+			ret = comms_recv_grow(conn);
+			if (ret && conn->recv_buf == NULL) {
+				*err = ERROR_NOT_ENOUGH_MEMORY;
 				return -1;
+			}
 
-			case MPC_PAUSE:
-				ret = snprintf(status->msg, sizeof(status->msg), "Pause command failed (%s)", data->parse_buf);
+			/* buffer overflow */
+			if (ret) {
+				odprintf("parse: sender overflowed %u byte buffer waiting for '\\n'", conn->recv_size);
+				conn->recv_start = 0;
+				conn->recv_len = 0;
+				conn->recv_discard = 1;
+			}
+		}
+
+		SetLastError(0);
+		ret = recv(conn->s, conn->recv_buf + conn->recv_start + conn->recv_len, conn->recv_size - conn->recv_start - conn->recv_len, 0);
+		*err = GetLastError();
+		odprintf("recv: %d (%ld)", ret, *err);
+		if (ret == SOCKET_ERROR && *err == WSAEWOULDBLOCK)
+			return changed;
+		if (ret <= 0)
+			return -1;
+
+		/* only the new data needs to be searched */
+		scan = conn->recv_len;
+		conn->recv_len += ret;
+
+		while ((end = memchr(conn->recv_buf + conn->recv_start + scan, '\n', conn->recv_len - scan)) != NULL) {
+			line = conn->recv_buf + conn->recv_start;
+			len = end - line;
+			*end = 0;
+
+			conn->recv_start += len + 1;
+			conn->recv_len -= len + 1;
+			scan = 0;
+
+			/* the rest of a line that was too long */
+			if (conn->recv_discard) {
+				conn->recv_discard = 0;
+				continue;
+			}
+
+			ret = comms_parse(hWnd, data, conn, line, len);
+			if (ret < 0)
+				return -2;
+			if (ret > 0)
+				changed = 1;
+		}
+
+		if (conn->recv_len == 0)
+			conn->recv_start = 0;
+	}
+}
+
+void comms_ctl_connect(HWND hWnd, struct slmpc_data *data) {
+	struct comms_conn *ctl = &data->ctl;
+	const char *fail;
+	INT ret;
+	DWORD err;
+
+	if (!data->opts.ctl_conn || !data->running)
+		return;
+
+	if (data->conn.s == INVALID_SOCKET || ctl->s != INVALID_SOCKET)
+		return;
+
+	odprintf("comms[ctl_connect]");
+
+	ctl->s = comms_socket(hWnd, data->conn_addr.family, &fail, &err);
+	if (ctl->s == INVALID_SOCKET) {
+		odprintf("comms[ctl_connect]: %s (%ld)", fail, err);
+		return;
+	}
+
+	comms_reset(ctl);
+	data->ctl_ready = 0;
+
+	SetLastError(0);
+	ret = connect(ctl->s, (const struct sockaddr*)&data->conn_addr.sa, data->conn_addr.sa_len);
+	err = GetLastError();
+	odprintf("connect: %d (%ld)", ret, err);
+	if (ret != 0 && err != WSAEWOULDBLOCK) {
+		comms_ctl_close(hWnd, data);
+		return;
+	}
+
+	/* limit how long the connection attempt can take */
+	comms_timer_set(hWnd, ctl->timer_id, data->conn.rto);
+}
+
+void comms_ctl_close(HWND hWnd, struct slmpc_data *data) {
+	struct comms_conn *ctl = &data->ctl;
+	INT ret;
+	DWORD err;
+
+	if (ctl->s != INVALID_SOCKET) {
+		odprintf("comms[ctl_close]");
+
+		SetLastError(0);
+		ret = closesocket(ctl->s);
+		err = GetLastError();
+		odprintf("closesocket: %d (%ld)", ret, err);
+
+		ctl->s = INVALID_SOCKET;
+	}
+
+	comms_reset(ctl);
+	comms_recv_free(ctl);
+	comms_timer_update(hWnd, ctl);
+	data->ctl_ready = 0;
+}
+
+/* The command connection has failed; if it had been working then rebuild it
+ * straight away, otherwise wait for the next ping interval to try again.
+ */
+void comms_ctl_lost(HWND hWnd, struct slmpc_data *data) {
+	int was_ready = data->ctl_ready;
+
+	odprintf("comms[ctl_lost]: ready=%d", was_ready);
+
+	comms_ctl_close(hWnd, data);
+	if (was_ready)
+		comms_ctl_connect(hWnd, data);
+}
+
+int comms_ctl_activity(HWND hWnd, struct slmpc_data *data, WORD sEvent, WORD sError) {
+	struct comms_conn *ctl = &data->ctl;
+	INT ret;
+	DWORD err;
+
+	odprintf("comms[ctl_activity]: sEvent=%d sError=%d", sEvent, sError);
+
+	switch (sEvent) {
+	case FD_CONNECT:
+		if (sError != 0) {
+			odprintf("FD_CONNECT failed (%d)", sError);
+			comms_ctl_close(hWnd, data);
+			break;
+		}
+
+		comms_queue(ctl, MPC_CONNECT, "");
+		if (data->password[0] != 0)
+			comms_queue(ctl, MPC_PASSWORD, "password %s\n", data->password);
+
+		ret = comms_flush(hWnd, ctl);
+		if (ret) {
+			odprintf("comms[ctl_activity]: error sending password (%d)", ret);
+			comms_ctl_close(hWnd, data);
+		}
+		break;
+
+	case FD_READ:
+		if (sError != 0) {
+			odprintf("FD_READ failed (%d)", sError);
+			comms_ctl_lost(hWnd, data);
+			break;
+		}
+
+		ret = comms_read(hWnd, data, ctl, &err);
+		if (ret < 0) {
+			odprintf("comms[ctl_activity]: read failed (%d, %ld)", ret, err);
+			comms_ctl_lost(hWnd, data);
+		} else if (ret > 0) {
+			tray_update(hWnd, data);
+		}
+		break;
+
+	case FD_CLOSE:
+		odprintf("FD_CLOSE (%d)", sError);
+		comms_ctl_lost(hWnd, data);
+		break;
+	}
+
+	return 0;
+}
+
+int comms_ctl_complete(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd) {
+	struct comms_conn *ctl = &data->ctl;
+	(void)hWnd;
+
+	switch (cmd) {
+	case MPC_CONNECT:
+	case MPC_PASSWORD:
+		if (ctl->inflight_count == 0) {
+			odprintf("comms[parse]: command connection ready");
+			data->ctl_ready = 1;
+		}
+		break;
+
+	case MPC_LIST:
+		/* the next play/pause request can be sent now */
+		comms_drain_post(hWnd, data);
+		break;
+
+	case MPC_STATUS:
+		comms_song_check(hWnd, data);
+		break;
+
+	case MPC_SONG:
+		comms_song_done(hWnd, data);
+		break;
+
+	case MPC_PLAY:
+	case MPC_PAUSE:
+	case MPC_PING:
+	case MPC_SKIP:
+	case MPC_SEEK:
+	case MPC_VOLUME:
+	case MPC_STOP:
+		break;
+
+	case MPC_NONE:
+	case MPC_IDLE:
+	case MPC_NOIDLE:
+		odprintf("comms[parse]: unexpected command %d on command connection", cmd);
+		return -1;
+	}
+
+	return 0;
+}
+
+int comms_ctl_failed(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd) {
+	struct comms_conn *ctl = &data->ctl;
+
+	switch (cmd) {
+	case MPC_PLAY:
+	case MPC_PAUSE:
+	case MPC_SKIP:
+	case MPC_SEEK:
+	case MPC_VOLUME:
+	case MPC_STOP:
+		/* the connection is still usable, but playback won't have
+		 * changed so get the real status to put the LED back
+		 */
+		odprintf("comms[parse]: command failed, requesting status");
+		comms_drain_post(hWnd, data);
+		comms_queue(ctl, MPC_STATUS, "status\n");
+		return comms_flush(hWnd, ctl) ? -1 : 0;
+
+	case MPC_SONG:
+		odprintf("comms[parse]: song request failed");
+		comms_song_reset(&data->song_next);
+		return 0;
+
+	default:
+		odprintf("comms[parse]: command %d failed", cmd);
+		return -1;
+	}
+}
+
+/* Send a command on the command connection, returns non-zero if it isn't
+ * available so that the caller can fall back to the idle connection.
+ */
+int comms_ctl_run(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd) {
+	struct comms_conn *ctl = &data->ctl;
+
+	if (ctl->s == INVALID_SOCKET || !data->ctl_ready)
+		return 1;
+
+	switch (cmd) {
+	case MPC_PLAY:
+	case MPC_PAUSE:
+		if (comms_inflight(ctl, MPC_PLAY) || comms_inflight(ctl, MPC_PAUSE))
+			return 1;
+
+		comms_queue_play(ctl, cmd);
+		break;
+
+	case MPC_PING:
+		if (ctl->inflight_count != 0)
+			return 0;
+
+		comms_queue(ctl, MPC_PING, "ping\n");
+		break;
+
+	default:
+		return 1;
+	}
+
+	odprintf("comms[ctl_run]: cmd=%d", cmd);
+
+	return comms_ctl_send(hWnd, data);
+}
+
+/* Send the key binding requests on the command connection, returns non-zero
+ * if it isn't available or the previous ones haven't finished yet.
+ */
+int comms_ctl_keys(HWND hWnd, struct slmpc_data *data) {
+	struct comms_conn *ctl = &data->ctl;
+
+	if (ctl->s == INVALID_SOCKET || !data->ctl_ready)
+		return 1;
+
+	if (comms_keys_inflight(ctl))
+		return 1;
+
+	comms_queue_keys(ctl, data);
+	return comms_ctl_send(hWnd, data);
+}
+
+int comms_ctl_send(HWND hWnd, struct slmpc_data *data) {
+	struct comms_conn *ctl = &data->ctl;
+	int ret;
+
+	ret = comms_flush(hWnd, ctl);
+	if (ret) {
+		odprintf("comms[ctl_send]: send failed (%d)", ret);
+		comms_ctl_lost(hWnd, data);
+		return 1;
+	}
+
+	return 0;
+}
+
+void comms_ctl_ping(HWND hWnd, struct slmpc_data *data) {
+	odprintf("comms[ctl_ping]");
+
+	if (data->conn.s == INVALID_SOCKET)
+		return;
+
+	if (data->ctl.s == INVALID_SOCKET)
+		comms_ctl_connect(hWnd, data);
+	else
+		comms_ctl_run(hWnd, data, MPC_PING);
+}
+
+void comms_ctl_timeout(HWND hWnd, struct slmpc_data *data) {
+	odprintf("comms[ctl_timeout]: cmd=%d", data->ctl.cmd);
+
+	comms_rtt_backoff(&data->ctl);
+
+	comms_ctl_lost(hWnd, data);
+}
+
+/* A command on the idle connection has completed */
+int comms_complete(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd) {
+	struct tray_status *status = &data->status;
+	struct comms_conn *conn = &data->conn;
+	int ret;
+
+	switch (cmd) {
+	case MPC_NONE:
+		odprintf("comms[parse]: no command running?");
+		ret = snprintf(status->msg, sizeof(status->msg), "Internal error, got OK response but no command was running");
+		if (ret < 0)
+			status->msg[0] = 0;
+		return -1;
+
+	case MPC_CONNECT:
+		odprintf("comms[parse]: connected");
+		break;
+
+	case MPC_PASSWORD:
+		odprintf("comms[parse]: authenticated");
+		break;
+
+	case MPC_STATUS:
+		odprintf("comms[parse]: status received");
+		data->retry_count = 0;
+
+		/* now that the state is known, put it back to what was requested */
+		if (data->replay) {
+			data->replay = 0;
+			PostMessage(hWnd, WM_APP_NET, 0, NET_MSG_REPLAY);
+		}
+
+		/* requests may have been waiting for the state to be known */
+		if (data->queue_count != 0)
+			comms_drain_post(hWnd, data);
+
+		comms_song_check(hWnd, data);
+		break;
+
+	case MPC_SONG:
+		comms_song_done(hWnd, data);
+		break;
+
+	case MPC_PING:
+		odprintf("comms[parse]: heartbeat received");
+		data->hb_outstanding = 0;
+		data->hb_misses = 0;
+		break;
+
+	case MPC_PLAY:
+	case MPC_PAUSE:
+		odprintf("comms[parse]: finished play/pause");
+		break;
+
+	case MPC_SKIP:
+	case MPC_SEEK:
+	case MPC_VOLUME:
+	case MPC_STOP:
+		odprintf("comms[parse]: finished key command %d", cmd);
+		break;
+
+	case MPC_LIST:
+		odprintf("comms[parse]: finished command list");
+		comms_drain_post(hWnd, data);
+		break;
+
+	case MPC_NOIDLE:
+		/* the commands that follow have already been sent */
+		odprintf("comms[parse]: resume from idle");
+		comms_dispatch(data);
+
+		/* and if they include a status request, it was sent after
+		 * any change that was reported before idle was cancelled
+		 */
+		if (comms_inflight(conn, MPC_STATUS))
+			comms_dequeue(data, MPC_STATUS);
+		if (comms_inflight(conn, MPC_SONG))
+			comms_dequeue(data, MPC_SONG);
+		comms_drain_post(hWnd, data);
+		break;
+
+	case MPC_IDLE:
+		odprintf("comms[parse]: resume from idle");
+		comms_dispatch(data);
+
+		if (conn->inflight_count != 0) {
+			odprintf("comms[parse]: commands already queued?");
+			break;
+		}
+
+		/* go idle again after sending anything that's waiting */
+		comms_drain_post(hWnd, data);
+		break;
+	}
+
+	return 0;
+}
+
+/* A command on the idle connection has failed */
+int comms_failed(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd, const char *line) {
+	struct tray_status *status = &data->status;
+	int ret;
+
+	switch (cmd) {
+	case MPC_NONE:
+		odprintf("comms[parse]: no command running?");
+		ret = snprintf(status->msg, sizeof(status->msg), "Internal error, got ACK response but no command was running");
+		if (ret < 0)
+			status->msg[0] = 0;
+		return -1;
+
+	case MPC_CONNECT:
+		ret = snprintf(status->msg, sizeof(status->msg), "Session start failed (%s)", line);
+		if (ret < 0)
+			status->msg[0] = 0;
+		return -1;
+
+	case MPC_PASSWORD:
+		ret = snprintf(status->msg, sizeof(status->msg), "Authentication failed (%s)", line);
+		if (ret < 0)
+			status->msg[0] = 0;
+		return -1;
+
+	case MPC_STATUS:
+		ret = snprintf(status->msg, sizeof(status->msg), "Status request failed (%s)", line);
+		if (ret < 0)
+			status->msg[0] = 0;
+		return -1;
+
+	case MPC_IDLE:
+		ret = snprintf(status->msg, sizeof(status->msg), "Idle command failed (%s)", line);
+		if (ret < 0)
+			status->msg[0] = 0;
+		return -1;
+
+	case MPC_NOIDLE:
+		ret = snprintf(status->msg, sizeof(status->msg), "Idle abort failed (%s)", line);
+		if (ret < 0)
+			status->msg[0] = 0;
+		return -1;
+
+	case MPC_PLAY:
+		ret = snprintf(status->msg, sizeof(status->msg), "Play command failed (%s)", line);
+		if (ret < 0)
+			status->msg[0] = 0;
+		return -1;
+
+	case MPC_PAUSE:
+		ret = snprintf(status->msg, sizeof(status->msg), "Pause command failed (%s)", line);
+		if (ret < 0)
+			status->msg[0] = 0;
+		return -1;
+
+	case MPC_PING:
+		ret = snprintf(status->msg, sizeof(status->msg), "Ping command failed (%s)", line);
+		if (ret < 0)
+			status->msg[0] = 0;
+		return -1;
+
+	case MPC_LIST:
+		ret = snprintf(status->msg, sizeof(status->msg), "Command list failed (%s)", line);
+		if (ret < 0)
+			status->msg[0] = 0;
+		return -1;
+
+	case MPC_SONG:
+		/* only needed for the tooltip */
+		odprintf("comms[parse]: song request failed (%s)", line);
+		comms_song_reset(&data->song_next);
+		return 0;
+
+	case MPC_SKIP:
+	case MPC_SEEK:
+	case MPC_VOLUME:
+	case MPC_STOP:
+		/* e.g. no next song, or nothing playing to seek in; the
+		 * status request in the same list was discarded with it
+		 */
+		odprintf("comms[parse]: key command %d failed, requesting status", cmd);
+		comms_enqueue(data, MPC_STATUS);
+		comms_drain_post(hWnd, data);
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Update the play state from a status response, and check it against any
+ * state that's being shown optimistically. A request that hasn't been sent
+ * or answered yet may still apply, otherwise it didn't work.
+ */
+void comms_state(struct slmpc_data *data, enum play_status play) {
+	struct tray_status *status = &data->status;
+
+	clock_sync(&data->clock, play);
+
+	if (status->play != play)
+		status->rejected = 0;
+	status->play = play;
+
+	if (status->pending == MPD_UNKNOWN)
+		return;
+
+	if (status->pending == play) {
+		odprintf("comms[state]: confirmed pending state %d", play);
+		status->pending = MPD_UNKNOWN;
+		return;
+	}
+
+	if (comms_play_queued(data)
+			|| comms_inflight(&data->conn, MPC_PLAY) || comms_inflight(&data->conn, MPC_PAUSE)
+			|| comms_inflight(&data->ctl, MPC_PLAY) || comms_inflight(&data->ctl, MPC_PAUSE))
+		return;
+
+	odprintf("comms[state]: pending state %d not applied, still %d", status->pending, play);
+	status->pending = MPD_UNKNOWN;
+	status->rejected = 1;
+}
+
+void comms_song_reset(struct mpd_song *song) {
+	song->id = -1;
+	song->title[0] = 0;
+	song->artist[0] = 0;
+	song->album[0] = 0;
+}
+
+/* Copy a tag, cutting it off at a character boundary if it's too long */
+void comms_tag(char *dst, size_t size, const char *value) {
+	size_t len = strlen(value);
+
+	if (len >= size) {
+		len = size - 1;
+
+		/* don't leave part of a UTF-8 sequence at the end */
+		while (len > 0 && (value[len] & 0xC0) == 0x80)
+			len--;
+	}
+
+	memcpy(dst, value, len);
+	dst[len] = 0;
+}
+
+/* One line of a currentsong response, which starts with the file name */
+int comms_song_parse(struct mpd_song *song, const char *msg_type, const char *value) {
+	const char *name;
+
+	if (*value == ' ')
+		value++;
+
+	if (!strcmp(msg_type, "file:")) {
+		name = strrchr(value, '/');
+		if (song->title[0] == 0)
+			comms_tag(song->title, sizeof(song->title), name != NULL ? name + 1 : value);
+	} else if (!strcmp(msg_type, "Title:")) {
+		comms_tag(song->title, sizeof(song->title), value);
+	} else if (!strcmp(msg_type, "Artist:")) {
+		comms_tag(song->artist, sizeof(song->artist), value);
+	} else if (!strcmp(msg_type, "Album:")) {
+		comms_tag(song->album, sizeof(song->album), value);
+	} else if (!strcmp(msg_type, "Name:")) {
+		if (song->album[0] == 0)
+			comms_tag(song->album, sizeof(song->album), value);
+	} else if (!strcmp(msg_type, "Id:")) {
+		song->id = strtol(value, NULL, 10);
+	}
+
+	return 0;
+}
+
+int comms_song_inflight(struct slmpc_data *data) {
+	return comms_inflight(&data->conn, MPC_SONG) || comms_inflight(&data->ctl, MPC_SONG);
+}
+
+/* The song is only fetched when the status says it has changed, so
+ * play/pause never costs an extra round trip. Requests that are likely
+ * to change it already have a currentsong command after their status.
+ */
+void comms_song_check(HWND hWnd, struct slmpc_data *data) {
+	if (data->status_song == data->song.id || comms_song_inflight(data))
+		return;
+
+	odprintf("comms[song_check]: song %ld changed to %ld", data->song.id, data->status_song);
+
+	if (data->status_song == -1) {
+		comms_song_reset(&data->song);
+		data->status.song = -1;
+		tray_update(hWnd, data);
+		return;
+	}
+
+	comms_enqueue(data, MPC_SONG);
+	comms_drain_post(hWnd, data);
+}
+
+void comms_song_done(HWND hWnd, struct slmpc_data *data) {
+	struct mpd_song *song = &data->song_next;
+
+	odprintf("comms[song]: id=%ld title=\"%s\" artist=\"%s\" album=\"%s\"", song->id, song->title, song->artist, song->album);
+
+	/* not when first connecting */
+	if (data->opts.balloon && song->id != data->song.id && data->song.id != -1 && song->id != -1)
+		data->tray_balloon = 1;
+
+	/* the id stays the same if only the tags were updated */
+	if (strcmp(song->title, data->song.title) || strcmp(song->artist, data->song.artist)
+			|| strcmp(song->album, data->song.album))
+		data->status.song_tags++;
+
+	data->song = *song;
+	data->status.song = song->id;
+	comms_song_reset(song);
+	tray_update(hWnd, data);
+}
+
+int comms_parse(HWND hWnd, struct slmpc_data *data, struct comms_conn *conn, char *line, unsigned int len) {
+	struct tray_status *status = &data->status;
+	struct comms_cmd entry;
+	char msg_type[64];
+	int ret;
+
+	odprintf("comms[parse]: %s \"%s\" (%u)", conn == &data->ctl ? "ctl" : "conn", line, len);
+
+	if (sscanf(line, "%63s", msg_type) == 1) {
+		if (!strcmp(msg_type, "OK") || !strcmp(msg_type, "list_OK")) {
+			if (conn->inflight_count == 0) {
+				if (conn == &data->ctl)
+					return -1;
+				return comms_complete(hWnd, data, MPC_NONE);
+			}
+
+			/* list_OK ends each command in a list, OK ends the list itself */
+			entry = comms_pop(conn);
+			comms_rtt_update(conn, &entry);
+			comms_timer_update(hWnd, conn);
+			if (entry.list != (msg_type[0] == 'l')) {
+				odprintf("comms[parse]: %s out of sequence for command %d", msg_type, entry.cmd);
+				if (conn == &data->ctl)
+					return -1;
+
+				ret = snprintf(status->msg, sizeof(status->msg), "Internal error, got %s response out of sequence", msg_type);
 				if (ret < 0)
 					status->msg[0] = 0;
 				return -1;
 			}
-			return -1;
+
+			if (conn == &data->ctl)
+				return comms_ctl_complete(hWnd, data, entry.cmd);
+			return comms_complete(hWnd, data, entry.cmd);
+		} else if (!strcmp(msg_type, "ACK")) {
+			if (conn->inflight_count == 0) {
+				if (conn == &data->ctl)
+					return -1;
+				return comms_failed(hWnd, data, MPC_NONE, line);
+			}
+
+			/* the server discards the rest of a command list after an error */
+			entry = comms_pop(conn);
+			comms_rtt_update(conn, &entry);
+			if (entry.list)
+				while (conn->inflight_count > 0 && comms_pop(conn).cmd != MPC_LIST);
+			comms_timer_update(hWnd, conn);
+
+			if (conn == &data->ctl)
+				return comms_ctl_failed(hWnd, data, entry.cmd);
+			return comms_failed(hWnd, data, entry.cmd, line);
 		} else {
-			switch (data->cmd) {
+			switch (conn->cmd) {
 			case MPC_NONE:
 				odprintf("comms[parse]: no command running?");
+				if (conn == &data->ctl)
+					return -1;
+
 				ret = snprintf(status->msg, sizeof(status->msg), "Internal error, got data but no command was running");
 				if (ret < 0)
 					status->msg[0] = 0;
@@ -833,48 +2067,58 @@ int comms_parse(HWND hWnd, struct slmpc_data *data) {
 				break;
 
 			case MPC_IDLE:
-				if (!strcmp(data->parse_buf, "changed: player")) {
-					if (data->pending_cmd == MPC_NONE) {
-						odprintf("comms[parse]: player change, queuing status request");
-						data->pending_cmd = MPC_STATUS;
-					} else {
-						odprintf("comms[parse]: player change, ignoring");
-					}
-				}
-				break;
-
 			case MPC_NOIDLE:
-				odprintf("comms[parse]: ignoring idle response");
+				if (!strcmp(msg_type, "changed:"))
+					comms_changed(data, line + strlen(msg_type));
 				break;
 
 			case MPC_STATUS:
 				if (!strcmp(msg_type, "state:")) {
-					if (!strcmp(data->parse_buf, "state: stop")) {
+					/* the song (if there is one) comes after the state */
+					data->status_song = -1;
+
+					if (!strcmp(line, "state: stop")) {
 						odprintf("comms[parse]: updating state (STOPPED)");
-						status->play = MPD_STOPPED;
-						if (data->sl_status == SL_ON)
+						comms_state(data, MPD_STOPPED);
+						if (data->sl_status == SL_ON && !comms_play_queued(data))
 							data->sl_status = kbd_set(SL_OFF);
 						return 1;
-					} else if (!strcmp(data->parse_buf, "state: play")) {
+					} else if (!strcmp(line, "state: play")) {
 						odprintf("comms[parse]: updating state (PLAYING)");
-						status->play = MPD_PLAYING;
-						if (data->sl_status == SL_OFF)
+						comms_state(data, MPD_PLAYING);
+						if (data->sl_status == SL_OFF && !comms_play_queued(data))
 							data->sl_status = kbd_set(SL_ON);
 						return 1;
-					} else if (!strcmp(data->parse_buf, "state: pause")) {
+					} else if (!strcmp(line, "state: pause")) {
 						odprintf("comms[parse]: updating state (PAUSED)");
-						status->play = MPD_PAUSED;
-						if (data->sl_status == SL_ON)
+						comms_state(data, MPD_PAUSED);
+						if (data->sl_status == SL_ON && !comms_play_queued(data))
 							data->sl_status = kbd_set(SL_OFF);
 						return 1;
 					} else {
 						odprintf("comms[parse]: updating state (UNKNOWN)");
-						status->play = MPD_UNKNOWN;
+						comms_state(data, MPD_UNKNOWN);
 						return 1;
 					}
+				} else if (!strcmp(msg_type, "songid:")) {
+					data->status_song = strtol(line + strlen(msg_type), NULL, 10);
+				} else if (!strcmp(msg_type, "volume:")) {
+					status->volume = strtol(line + strlen(msg_type), NULL, 10);
+					return 1;
+				} else if (!strcmp(msg_type, "repeat:")) {
+					status->repeat = strtol(line + strlen(msg_type), NULL, 10) != 0;
+					return 1;
+				} else if (!strcmp(msg_type, "random:")) {
+					status->random = strtol(line + strlen(msg_type), NULL, 10) != 0;
+					return 1;
+				} else {
+					return clock_parse(&data->clock, msg_type, line + strlen(msg_type));
 				}
 				break;
 
+			case MPC_SONG:
+				return comms_song_parse(&data->song_next, msg_type, line + strlen(msg_type));
+
 			case MPC_PLAY:
 				odprintf("comms[parse]: ignoring play response");
 				break;
@@ -882,6 +2126,21 @@ int comms_parse(HWND hWnd, struct slmpc_data *data) {
 			case MPC_PAUSE:
 				odprintf("comms[parse]: ignoring pause response");
 				break;
+
+			case MPC_PING:
+				odprintf("comms[parse]: ignoring ping response");
+				break;
+
+			case MPC_LIST:
+				odprintf("comms[parse]: ignoring command list response");
+				break;
+
+			case MPC_SKIP:
+			case MPC_SEEK:
+			case MPC_VOLUME:
+			case MPC_STOP:
+				odprintf("comms[parse]: ignoring key command response");
+				break;
 			}
 		}
 	}
@@ -889,84 +2148,467 @@ int comms_parse(HWND hWnd, struct slmpc_data *data) {
 	return 0;
 }
 
-int comms_run(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd) {
-	struct tray_status *status = &data->status;
-	INT ret;
+/* The names all have different lengths, so that's used to find the entry
+ * for a changed line, which is then confirmed with strcmp so that other
+ * subsystems of the same length are ignored (check this when adding one)
+ */
+#define COMMS_EVENT_LEN 9
+static const struct comms_event comms_events[COMMS_EVENT_LEN] = {
+	[5] = { "mixer", IDLE_MIXER, comms_changed_status },
+	[6] = { "player", IDLE_PLAYER, comms_changed_status },
+	[7] = { "options", IDLE_OPTIONS, comms_changed_status },
+	[8] = { "playlist", IDLE_PLAYLIST, comms_changed_status }
+};
+
+/* "idle" followed by each of the subsystems in comms_events */
+void comms_queue_idle(struct comms_conn *conn) {
+	char names[128] = "";
+	size_t len = 0;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < COMMS_EVENT_LEN; i++) {
+		if (comms_events[i].name == NULL)
+			continue;
+
+		ret = snprintf(names + len, sizeof(names) - len, " %s", comms_events[i].name);
+		if (ret > 0 && (size_t)ret < sizeof(names) - len)
+			len += ret;
+	}
+
+	comms_queue(conn, MPC_IDLE, "idle%s\n", names);
+}
+
+/* What needs to be requested again after a wake-up, sent together */
+void comms_queue_queries(struct comms_conn *conn, int status, int song) {
+	if (status && song)
+		comms_list_begin(conn);
+	if (status)
+		comms_queue(conn, MPC_STATUS, "status\n");
+	if (song)
+		comms_queue(conn, MPC_SONG, "currentsong\n");
+	if (status && song)
+		comms_list_end(conn);
+}
+
+/* A "changed: <subsystem>" line, which is only recorded until idle has
+ * finished so that several changes only cause one set of requests
+ */
+void comms_changed(struct slmpc_data *data, const char *name) {
+	size_t len;
+
+	while (*name == ' ')
+		name++;
+	len = strlen(name);
+
+	if (len < COMMS_EVENT_LEN && comms_events[len].name != NULL && !strcmp(comms_events[len].name, name)) {
+		odprintf("comms[changed]: %s", name);
+		data->idle_changed |= comms_events[len].subsystem;
+	} else {
+		odprintf("comms[changed]: ignoring %s", name);
+	}
+}
+
+/* The play state, volume (mixer) and repeat/random (options) are all in the
+ * status, as is the song id which comms_song_check uses to decide whether a
+ * playlist change needs the current song to be requested again
+ */
+void comms_changed_status(struct slmpc_data *data) {
+	comms_enqueue(data, MPC_STATUS);
+}
+
+void comms_dispatch(struct slmpc_data *data) {
+	unsigned int i;
+
+	if (data->idle_changed == 0)
+		return;
+
+	odprintf("comms[dispatch]: changed=%#x", data->idle_changed);
+
+	for (i = 0; i < COMMS_EVENT_LEN; i++)
+		if (comms_events[i].name != NULL && (data->idle_changed & comms_events[i].subsystem))
+			comms_events[i].handler(data);
+	data->idle_changed = 0;
+}
+
+/* Requests are queued so that a new one can replace or merge with an earlier
+ * one that hasn't been sent yet. Only the last play/pause request matters and
+ * a status request only needs to be sent once.
+ */
+void comms_enqueue(struct slmpc_data *data, enum cmd_status cmd) {
+	unsigned int i;
+
+	odprintf("comms[enqueue]: cmd=%d queued=%u", cmd, data->queue_count);
+
+	for (i = 0; i < data->queue_count; i++) {
+		if ((cmd == MPC_STATUS || cmd == MPC_SONG) && data->queue[i] == cmd)
+			return;
+
+		if ((cmd == MPC_PLAY || cmd == MPC_PAUSE)
+				&& (data->queue[i] == MPC_PLAY || data->queue[i] == MPC_PAUSE)) {
+			odprintf("comms[enqueue]: replacing cmd=%d", data->queue[i]);
+			comms_dequeue(data, data->queue[i]);
+			break;
+		}
+	}
+
+	if (data->queue_count == COMMS_MAX_QUEUED) {
+		odprintf("comms[enqueue]: queue full");
+		return;
+	}
+
+	data->queue[data->queue_count++] = cmd;
+}
+
+void comms_dequeue(struct slmpc_data *data, enum cmd_status cmd) {
+	unsigned int i, j;
+
+	for (i = 0, j = 0; i < data->queue_count; i++)
+		if (data->queue[i] != cmd)
+			data->queue[j++] = data->queue[i];
+	data->queue_count = j;
+}
+
+int comms_play_queued(struct slmpc_data *data) {
+	unsigned int i;
+
+	/* not queued yet, but it will be */
+	if (data->kbd_pending)
+		return 1;
+
+	for (i = 0; i < data->queue_count; i++)
+		if (data->queue[i] == MPC_PLAY || data->queue[i] == MPC_PAUSE)
+			return 1;
+	return 0;
+}
+
+/* Drain the queue later, when it's not safe to send from where we are */
+void comms_drain_post(HWND hWnd, struct slmpc_data *data) {
+	BOOL ret;
 	DWORD err;
 
-	odprintf("comms[run]: cmd=%d", cmd);
+	if (data->drain_posted)
+		return;
 
-	if (status->conn != CONNECTED)
-		return 0;
-	if (status->play == MPD_UNKNOWN)
+	SetLastError(0);
+	ret = PostMessage(hWnd, WM_APP_NET, 0, NET_MSG_DRAIN);
+	err = GetLastError();
+	odprintf("PostMessage: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+	data->drain_posted = (ret == TRUE);
+}
+
+/* Send as much of the queue as possible. A play/pause request waits until
+ * the previous one has finished, and anything on the idle connection waits
+ * until it is idle (or about to be) again. Returns non-zero if sending on
+ * the idle connection failed.
+ */
+int comms_drain_send(HWND hWnd, struct slmpc_data *data) {
+	struct tray_status *status = &data->status;
+	struct comms_conn *conn = &data->conn;
+	enum cmd_status cmd, play = MPC_NONE;
+	int want_status = 0, want_song = 0, can_send, busy, ctl, keys;
+	unsigned int i, j;
+
+	odprintf("comms[drain]: queued=%u", data->queue_count);
+
+	can_send = conn->inflight_count == 0 || comms_idle_tail(conn);
+	busy = comms_inflight(conn, MPC_PLAY) || comms_inflight(conn, MPC_PAUSE)
+		|| comms_inflight(&data->ctl, MPC_PLAY) || comms_inflight(&data->ctl, MPC_PAUSE);
+	ctl = data->ctl.s != INVALID_SOCKET && data->ctl_ready;
+	keys = comms_keys_pending(data) && !comms_keys_inflight(conn) && !comms_keys_inflight(&data->ctl);
+
+	for (i = 0, j = 0; i < data->queue_count; i++) {
+		cmd = data->queue[i];
+
+		switch (cmd) {
+		case MPC_STATUS:
+			if (can_send) {
+				want_status = 1;
+				continue;
+			}
+			break;
+
+		case MPC_SONG:
+			if (can_send) {
+				want_song = 1;
+				continue;
+			}
+			break;
+
+		case MPC_PLAY:
+		case MPC_PAUSE:
+			if (busy || status->play == MPD_UNKNOWN)
+				break;
+
+			if ((cmd == MPC_PLAY) == (status->play == MPD_PLAYING)) {
+				odprintf("comms[drain]: already in requested state, dropping cmd=%d", cmd);
+				continue;
+			}
+
+			if (ctl || can_send) {
+				play = cmd;
+				continue;
+			}
+			break;
+
+		default:
+			continue;
+		}
+
+		data->queue[j++] = cmd;
+	}
+	data->queue_count = j;
+
+	/* send it directly on the command connection if there is one */
+	if (play != MPC_NONE && ctl) {
+		if (comms_ctl_run(hWnd, data, play) == 0) {
+			play = MPC_NONE;
+		} else if (!can_send) {
+			comms_enqueue(data, play);
+			play = MPC_NONE;
+		}
+	}
+
+	if (keys && ctl) {
+		if (comms_ctl_keys(hWnd, data) == 0 || !can_send)
+			keys = 0;
+	} else if (keys && !can_send) {
+		keys = 0;
+	}
+
+	if (play == MPC_NONE && !want_status && !want_song && !keys && conn->inflight_count != 0)
 		return 0;
 
-	switch (data->cmd) {
-	case MPC_NONE:
-	case MPC_CONNECT:
-	case MPC_PASSWORD:
-		odprintf("comms[run]: connection not ready for commands");
+	/* everything ends with a request to go idle, so
+	 * any other commands can be sent after cancelling it
+	 */
+	comms_noidle(conn);
+	if (play != MPC_NONE)
+		comms_queue_play(conn, play);
+	if (keys)
+		comms_queue_keys(conn, data);
+	comms_queue_queries(conn, want_status && play == MPC_NONE && !keys, want_song && !comms_song_inflight(data));
+	comms_queue_idle(conn);
+
+	return comms_flush(hWnd, conn);
+}
+
+int comms_drain(HWND hWnd, struct slmpc_data *data) {
+	struct tray_status *status = &data->status;
+	INT ret;
+
+	data->drain_posted = 0;
+
+	if (status->conn != CONNECTED || data->conn.s == INVALID_SOCKET)
 		return 0;
 
-	case MPC_IDLE:
-		ret = comms_send(data->s, "noidle\n");
-		if (ret) {
-			status->conn = NOT_CONNECTED;
+	ret = comms_drain_send(hWnd, data);
+	if (ret) {
+		status->conn = NOT_CONNECTED;
 
-			ret = snprintf(status->msg, sizeof(status->msg), "Error exiting idle mode (%d)", ret);
-			if (ret < 0)
-				status->msg[0] = 0;
-			tray_update(hWnd, data);
+		ret = snprintf(status->msg, sizeof(status->msg), "Error exiting idle mode (%d)", ret);
+		if (ret < 0)
+			status->msg[0] = 0;
+		tray_update(hWnd, data);
 
-			SetLastError(0);
-			ret = closesocket(data->s);
-			err = GetLastError();
-			odprintf("closesocket: %d (%ld)", ret, err);
+		comms_close(hWnd, data);
+		return 1;
+	}
 
-			data->s = INVALID_SOCKET;
-			comms_timer_stop(hWnd);
-			data->cmd = MPC_NONE;
-			return 1;
-		}
+	return 0;
+}
+
+int comms_run(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd) {
+	struct tray_status *status = &data->status;
 
-		data->cmd = MPC_NOIDLE;
-		comms_timer_start(hWnd);
+	odprintf("comms[run]: cmd=%d", cmd);
 
-	case MPC_STATUS:
-		data->pending_cmd = cmd;
+	if (status->conn != CONNECTED)
 		return 0;
 
-	case MPC_NOIDLE:
+	switch (cmd) {
 	case MPC_PLAY:
 	case MPC_PAUSE:
-		odprintf("comms[run]: command already running");
+	case MPC_STATUS:
+		comms_enqueue(data, cmd);
+		break;
+
+	default:
+		odprintf("comms[run]: invalid command");
 		return 0;
 	}
 
-	return 0;
+	return comms_drain(hWnd, data);
 }
 
 int comms_kbd(HWND hWnd, struct slmpc_data *data) {
 	struct tray_status *status = &data->status;
 	enum sl_status current;
+	enum cmd_status cmd;
 
 	odprintf("comms[kbd]");
 
-	if (status->conn != CONNECTED)
-		return 0;
-	if (status->play == MPD_UNKNOWN)
+	current = kbd_pressed(data->sl_status);
+	if (current == data->sl_status)
 		return 0;
-
-	current = kbd_get();
+	data->sl_status = current;
 
 	switch (current) {
 	case SL_ON:
-		if (data->sl_status == SL_OFF && status->play != MPD_PLAYING)
-			return comms_run(hWnd, data, MPC_PLAY);
+		cmd = MPC_PLAY;
 		break;
 
 	case SL_OFF:
-		if (data->sl_status == SL_ON && status->play == MPD_PLAYING)
+		cmd = MPC_PAUSE;
+		break;
+
+	default:
+		return 0;
+	}
+
+	/* remember what was asked for so that it can be replayed after reconnecting */
+	data->replay_cmd = cmd;
+	data->kbd_presses++;
+
+	if (status->conn != CONNECTED) {
+		odprintf("comms[kbd]: not connected, will replay %d", cmd);
+		data->replay = 1;
+		return 0;
+	}
+
+	if (data->opts.optimistic)
+		comms_optimistic(hWnd, data, cmd);
+
+	if (data->opts.kbd_debounce == 0)
+		return comms_run(hWnd, data, cmd);
+
+	/* the first press is sent straight away, any more are held back
+	 * until the key hasn't been pressed for a while and then only
+	 * the final state is sent
+	 */
+	comms_timer_set(hWnd, DEBOUNCE_TIMER_ID, data->opts.kbd_debounce);
+	if (!data->kbd_window) {
+		data->kbd_window = 1;
+		return comms_run(hWnd, data, cmd);
+	}
+
+	if (data->kbd_pending)
+		data->kbd_suppressed++;
+	data->kbd_pending = 1;
+	return 0;
+}
+
+/* Show the requested state before the server has confirmed it */
+void comms_optimistic(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd) {
+	struct tray_status *status = &data->status;
+	enum play_status pending = MPD_UNKNOWN;
+
+	/* the same checks as comms_drain_send(), for whether anything will change */
+	if (status->play != MPD_UNKNOWN && (cmd == MPC_PLAY) != (status->play == MPD_PLAYING))
+		pending = cmd == MPC_PLAY ? MPD_PLAYING : MPD_PAUSED;
+
+	odprintf("comms[optimistic]: play=%d pending=%d", status->play, pending);
+
+	if (pending == status->pending && !status->rejected)
+		return;
+
+	status->pending = pending;
+	status->rejected = 0;
+	tray_update(hWnd, data);
+}
+
+int comms_kbd_debounced(HWND hWnd, struct slmpc_data *data) {
+	struct tray_status *status = &data->status;
+
+	comms_timer_kill(hWnd, DEBOUNCE_TIMER_ID);
+	data->kbd_window = 0;
+	if (!data->kbd_pending)
+		return 0;
+	data->kbd_pending = 0;
+
+	odprintf("comms[kbd_debounced]: cmd=%d presses=%u suppressed=%u", data->replay_cmd, data->kbd_presses, data->kbd_suppressed);
+
+	if (status->conn != CONNECTED) {
+		odprintf("comms[kbd_debounced]: not connected, will replay %d", data->replay_cmd);
+		data->replay = 1;
+		return 0;
+	}
+
+	return comms_run(hWnd, data, data->replay_cmd);
+}
+
+/* A bound key has been pressed. Repeated presses are merged until they can
+ * be sent: volume and seek amounts add up, and next/previous are counted
+ * and sent together in one command list.
+ */
+int comms_key(HWND hWnd, struct slmpc_data *data, enum kbd_action action) {
+	struct tray_status *status = &data->status;
+
+	odprintf("comms[key]: action=%d", action);
+
+	if (status->conn != CONNECTED) {
+		odprintf("comms[key]: not connected, ignoring");
+		return 0;
+	}
+
+	switch (action) {
+	case KBD_ACTION_NEXT:
+		if (data->key_skip < COMMS_MAX_SKIP)
+			data->key_skip++;
+		break;
+
+	case KBD_ACTION_PREVIOUS:
+		if (data->key_skip > -COMMS_MAX_SKIP)
+			data->key_skip--;
+		break;
+
+	case KBD_ACTION_STOP:
+		/* there will be nothing to seek in */
+		data->key_seek = 0;
+		data->key_stop = 1;
+		break;
+
+	case KBD_ACTION_VOLUME_UP:
+		data->key_volume += data->opts.volume_step;
+		if (data->key_volume > 100)
+			data->key_volume = 100;
+		break;
+
+	case KBD_ACTION_VOLUME_DOWN:
+		data->key_volume -= data->opts.volume_step;
+		if (data->key_volume < -100)
+			data->key_volume = -100;
+		break;
+
+	case KBD_ACTION_SEEK_FORWARD:
+		data->key_seek += data->opts.seek_step;
+		break;
+
+	case KBD_ACTION_SEEK_BACK:
+		data->key_seek -= data->opts.seek_step;
+		break;
+
+	default:
+		return 0;
+	}
+
+	return comms_drain(hWnd, data);
+}
+
+/* Restore the last requested play state after reconnecting */
+int comms_replay(HWND hWnd, struct slmpc_data *data) {
+	struct tray_status *status = &data->status;
+
+	odprintf("comms[replay]: cmd=%d play=%d", data->replay_cmd, status->play);
+
+	switch (data->replay_cmd) {
+	case MPC_PLAY:
+		if (status->play != MPD_PLAYING)
+			return comms_run(hWnd, data, MPC_PLAY);
+		break;
+
+	case MPC_PAUSE:
+		if (status->play == MPD_PLAYING)
 			return comms_run(hWnd, data, MPC_PAUSE);
 		break;
 
@@ -974,37 +2616,99 @@ int comms_kbd(HWND hWnd, struct slmpc_data *data) {
 		break;
 	}
 
-	data->sl_status = current;
 	return 0;
 }
 
-void comms_timer_start(HWND hWnd) {
+/* Check that the server is still responding, by briefly leaving idle mode
+ * to send a ping. The connection is considered dead if the ping isn't
+ * answered within the configured number of heartbeat intervals.
+ */
+int comms_heartbeat(HWND hWnd, struct slmpc_data *data) {
+	struct tray_status *status = &data->status;
+	struct comms_conn *conn = &data->conn;
 	INT ret;
-	DWORD err;
 
-	odprintf("comms[timer] start");
+	odprintf("comms[heartbeat]: outstanding=%d misses=%u", data->hb_outstanding, data->hb_misses);
+
+	if (status->conn != CONNECTED || conn->s == INVALID_SOCKET)
+		return 0;
+
+	if (data->hb_outstanding) {
+		data->hb_misses++;
+		if (data->hb_misses < data->opts.hb_misses)
+			return 0;
+
+		comms_disconnect(hWnd, data);
+
+		ret = snprintf(status->msg, sizeof(status->msg), "No response to heartbeat for %ums", data->hb_misses * data->opts.hb_interval);
+		if (ret < 0)
+			status->msg[0] = 0;
+		tray_update(hWnd, data);
+
+		if (data->replay_cmd != MPC_NONE)
+			data->replay = 1;
+		return 1;
+	}
+
+	/* other commands are running, their own timeout applies */
+	if (!comms_noidle(conn))
+		return 0;
+
+	comms_queue(conn, MPC_PING, "ping\n");
+	comms_queue_idle(conn);
+
+	ret = comms_flush(hWnd, conn);
+	if (ret) {
+		status->conn = NOT_CONNECTED;
+
+		ret = snprintf(status->msg, sizeof(status->msg), "Error sending heartbeat (%d)", ret);
+		if (ret < 0)
+			status->msg[0] = 0;
+		tray_update(hWnd, data);
+
+		comms_close(hWnd, data);
+		return 1;
+	}
+
+	data->hb_outstanding = 1;
+	return 0;
+}
+
+void comms_timer_set(HWND hWnd, UINT_PTR id, UINT timeout) {
+	UINT_PTR ret;
+	DWORD err;
 
 	SetLastError(0);
-	ret = SetTimer(hWnd, CMD_TIMER_ID, CMD_TIMEOUT, NULL);
+	ret = SetTimer(hWnd, id, timeout, NULL);
 	err = GetLastError();
-	odprintf("SetTimer: %d (%ld)", ret, err);
+	odprintf("SetTimer[%u]: %d (%ld)", id, ret, err);
 }
 
-void comms_timer_stop(HWND hWnd) {
+void comms_timer_kill(HWND hWnd, UINT_PTR id) {
 	BOOL ret;
 	DWORD err;
 
-	odprintf("comms[timer] stop");
-
 	SetLastError(0);
-	ret = KillTimer(hWnd, CMD_TIMER_ID);
+	ret = KillTimer(hWnd, id);
 	err = GetLastError();
-	odprintf("KillTimer: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+	odprintf("KillTimer[%u]: %s (%ld)", id, ret == TRUE ? "TRUE" : "FALSE", err);
+}
+
+/* Time the response to the command at the head of the queue; idle has no
+ * time limit and commands that start or stop playback have a longer one.
+ */
+void comms_timer_update(HWND hWnd, struct comms_conn *conn) {
+	odprintf("comms[timer] cmd=%d", conn->cmd);
+
+	if (conn->cmd == MPC_NONE || conn->cmd == MPC_IDLE)
+		comms_timer_kill(hWnd, conn->timer_id);
+	else
+		comms_timer_set(hWnd, conn->timer_id, comms_rtt_timeout(conn, conn->cmd));
 }
 
 void comms_timeout(HWND hWnd, struct slmpc_data *data) {
 	struct tray_status *status = &data->status;
-	enum cmd_status cmd = data->cmd;
+	enum cmd_status cmd = data->conn.cmd;
 	static char *cmds[] = {
 	/* MPC_NONE */ "unknown",
 	/* MPC_CONNECT */ "new connection",
@@ -1013,19 +2717,28 @@ void comms_timeout(HWND hWnd, struct slmpc_data *data) {
 	/* MPC_IDLE */ "idle command",
 	/* MPC_NOIDLE */ "noidle command",
 	/* MPC_PLAY */ "play command",
-	/* MPC_PAUSE */ "pause command"
+	/* MPC_PAUSE */ "pause command",
+	/* MPC_PING */ "ping command",
+	/* MPC_LIST */ "command list",
+	/* MPC_SKIP */ "next/previous command",
+	/* MPC_SEEK */ "seek command",
+	/* MPC_VOLUME */ "volume command",
+	/* MPC_STOP */ "stop command",
+	/* MPC_SONG */ "currentsong command"
 	};
 	INT ret;
 
 	odprintf("comms[timeout]");
 
-	if (data->s == INVALID_SOCKET)
+	if (data->conn.s == INVALID_SOCKET)
 		return;
 
-	comms_disconnect(hWnd, data);
-
-	ret = snprintf(status->msg, sizeof(status->msg), "Timeout waiting for response to %s", cmds[cmd]);
+	ret = snprintf(status->msg, sizeof(status->msg), "Timeout waiting %lums for response to %s", comms_rtt_timeout(&data->conn, cmd), cmds[cmd]);
 	if (ret < 0)
 		status->msg[0] = 0;
+
+	/* back off in case it was just slower than expected */
+	comms_rtt_backoff(&data->conn);
+	comms_disconnect(hWnd, data);
 	tray_update(hWnd, data);
 }
@@ -24,13 +24,45 @@ struct tcp_keepalive {
 }; 
 #endif
 
-#define CMD_TIMEOUT 30000 /* 30 seconds */
+/* command timeouts, from the round trip time */
+#define RTO_INITIAL 3000 /* 3 seconds */
+#define RTO_MIN 250 /* 250 milliseconds */
+#define RTO_WORK_MIN 2000 /* 2 seconds, for play/pause/next/previous/seek/stop */
+#define RTO_MAX 30000 /* 30 seconds */
+#define RTO_GRANULARITY 20 /* timer resolution */
+#define CONNECT_STAGGER 250 /* 250 milliseconds between connection attempts */
+#define CTL_PING_INTERVAL 20000 /* 20 seconds */
+#define RECV_BUF_MIN 1024
+#define RECV_BUF_MAX 65536 /* longest line accepted from the server */
+
+/* Each subsystem that idle reports changes for, and the handler that
+ * queues whatever needs to be requested again
+ */
+struct comms_event {
+	const char *name;
+	unsigned int subsystem; /* IDLE_* */
+	void (*handler)(struct slmpc_data *data);
+};
 
 int comms_init(struct slmpc_data *data);
 void comms_destroy(HWND hWnd, struct slmpc_data *data);
 void comms_disconnect(HWND hWnd, struct slmpc_data *data);
+void comms_net_changed(struct slmpc_data *data);
 int comms_connect(HWND hWnd, struct slmpc_data *data);
+#if HAVE_GETADDRINFO
+int comms_resolved(HWND hWnd, struct slmpc_data *data, struct comms_resolve *req);
+#endif
+int comms_connect_timer(HWND hWnd, struct slmpc_data *data);
 int comms_activity(HWND hWnd, struct slmpc_data *data, SOCKET s, WORD sEvent, WORD sError);
-int comms_parse(HWND hWnd, struct slmpc_data *data);
+int comms_parse(HWND hWnd, struct slmpc_data *data, struct comms_conn *conn, char *line, unsigned int len);
 int comms_kbd(HWND hWnd, struct slmpc_data *data);
+int comms_kbd_debounced(HWND hWnd, struct slmpc_data *data);
+int comms_key(HWND hWnd, struct slmpc_data *data, enum kbd_action action);
+int comms_replay(HWND hWnd, struct slmpc_data *data);
+int comms_heartbeat(HWND hWnd, struct slmpc_data *data);
 void comms_timeout(HWND hWnd, struct slmpc_data *data);
+void comms_ctl_ping(HWND hWnd, struct slmpc_data *data);
+void comms_ctl_timeout(HWND hWnd, struct slmpc_data *data);
+int comms_run(HWND hWnd, struct slmpc_data *data, enum cmd_status cmd);
+int comms_drain(HWND hWnd, struct slmpc_data *data);
+void comms_song_reset(struct mpd_song *song);
@@ -16,3 +16,5 @@
  */
 
 #define HAVE_GETADDRINFO (_WIN32_WINNT >= 0x0501)
+#define HAVE_CANCELIPCHANGENOTIFY (_WIN32_WINNT >= 0x0600)
+#define HAVE_RAWINPUT (_WIN32_WINNT >= 0x0501)
@@ -15,111 +15,170 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
 #include <windows.h>
 
 #include "debug.h"
 #include "icon.h"
+#include "icons.h"
 
-static HBITMAP hbmMask;
-static unsigned char icon_and[ICON_HEIGHT * ICON_MASK_SCANLINE_BYTES];
-static unsigned char icon_buf[ICON_HEIGHT * ICON_DATA_SCANLINE_BYTES];
+/* Premultiplied 0xAARRGGBB, row-major from the top, cur_size x cur_size pixels */
+static unsigned int cur_size = ICON_DEFAULT_SIZE;
+static unsigned int icon_buf[ICON_MAX_SIZE * ICON_MAX_SIZE];
+static unsigned char icon_and[ICON_MAX_SIZE * ICON_MASK_SCANLINE_BYTES(ICON_MAX_SIZE)];
 
-static inline void icon_set(unsigned int x, unsigned int y, unsigned int c) {
-	unsigned int d;
+/* AND mask for icon_buf, set by icon_tint: all clear when the background is
+ * opaque, the generated one when it's transparent, or NULL if it has to be
+ * made from the alpha (a scaled asset on a partly transparent background)
+ */
+static const unsigned char icon_opaque[ICON_MAX_SIZE * ICON_MASK_SCANLINE_BYTES(ICON_MAX_SIZE)];
+static const unsigned char *icon_mask = icon_opaque;
+
+/* An asset scaled to cur_size, when there isn't one already */
+static unsigned int icon_scaled[ICON_MAX_SIZE * ICON_MAX_SIZE];
+
+/* Mix two premultiplied colours, by the amount of the first one out of 255.
+ * Two channels are done at once in each half of a 32-bit value, which has
+ * room for the products, so this has no branches and the loops that use it
+ * can be vectorised.
+ */
+static inline unsigned int icon_mix(unsigned int c1, unsigned int c2, unsigned int a) {
+	unsigned int rb, ag;
+
+	rb = (c1 & 0x00FF00FF) * a + (c2 & 0x00FF00FF) * (255 - a);
+	ag = ((c1 >> 8) & 0x00FF00FF) * a + ((c2 >> 8) & 0x00FF00FF) * (255 - a);
+
+	/* divide each channel by 255, rounded */
+	rb += 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+	ag += 0x00800080;
+	ag = ((ag + ((ag >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
 
-	for (d = 0; d < ICON_DEPTH_BYTES; d++)
-		icon_buf[y * ICON_DATA_SCANLINE_BYTES + x * ICON_DEPTH_BYTES + d] = (c >> (d << 3)) & 0xFF;
+	return rb | (ag << 8);
 }
 
-static inline unsigned int icon_bpp_adjust(unsigned int c) {
-#if ICON_DEPTH_BITS == 32
-	/* Ignore transparency */
-	return c & 0xff000000;
-#elif ICON_DEPTH_BITS == 24
-	return c;
-#elif ICON_DEPTH_BITS == 16
-	return ((c >> 9) & 0x7c00) | ((c >> 5) & 0x7c0) | (c >> 3);
-#else
-#	error "Unable to handle icon bit depth"
-#endif
+static inline unsigned int icon_premultiply(unsigned int c) {
+	return (c & 0xFF000000) | (icon_mix(c, 0, c >> 24) & 0x00FFFFFF);
 }
 
-int icon_init(void) {
-	DWORD err;
+/* Icons use straight alpha */
+static inline unsigned int icon_unpremultiply(unsigned int c) {
+	unsigned int a = c >> 24;
 
-	odprintf("icon[init]");
+	if (a == 0 || a == 255)
+		return c;
 
-	memset(icon_and, 0, sizeof(icon_and));
+	return (c & 0xFF000000)
+		| (((c >> 16 & 0xFF) * 255 / a) << 16)
+		| (((c >> 8 & 0xFF) * 255 / a) << 8)
+		| ((c & 0xFF) * 255 / a);
+}
 
-	SetLastError(0);
-	hbmMask = CreateBitmap(ICON_WIDTH, ICON_HEIGHT, 1, 1, icon_and);
-	err = GetLastError();
-	odprintf("CreateBitmap: %p (%ld)", hbmMask, err);
+static void icon_tint_rows(unsigned int fg1, unsigned int bg1, unsigned int cx, unsigned int fg2, unsigned int bg2, const struct icon_asset *asset);
 
-	if (hbmMask == NULL)
-		return 1;
+#if DEBUG >= 2
+/* How the icon used to be drawn: one column at a time, one byte at a time,
+ * into a 24bpp buffer from 1bpp data. Kept to compare against.
+ */
+static void icon_bench_reference(unsigned char *buf, unsigned int fg, unsigned int bg, const unsigned char *data) {
+	unsigned int row_b = (ICON_DEFAULT_SIZE + 7) >> 3;
+	unsigned int scanline = (ICON_DEFAULT_SIZE * 24 + 15) >> 3 & ~1;
+	unsigned int x, y, d, c;
+
+	for (x = 0; x < ICON_DEFAULT_SIZE; x++) {
+		for (y = 0; y < ICON_DEFAULT_SIZE; y++) {
+			if ((data[row_b * y + (x >> 3)] >> (x & 7)) & 1)
+				c = fg;
+			else
+				c = bg;
+
+			for (d = 0; d < 3; d++)
+				buf[y * scanline + x * 3 + d] = (c >> (d << 3)) & 0xFF;
+		}
+	}
+}
+
+static void icon_bench(void) {
+	static unsigned char data[ICON_DEFAULT_SIZE * ((ICON_DEFAULT_SIZE + 7) >> 3)];
+	static unsigned char buf[ICON_DEFAULT_SIZE * ((ICON_DEFAULT_SIZE * 24 + 15) >> 3 & ~1)];
+	LARGE_INTEGER freq, start, mid, end;
+	const struct icon_asset *asset = icon_asset(unknown_icon, ICON_DEFAULT_SIZE);
+	unsigned int i;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i * 0x5B;
+
+	if (!QueryPerformanceFrequency(&freq) || asset->size != ICON_DEFAULT_SIZE)
+		return;
+	icon_resize(ICON_DEFAULT_SIZE);
+
+	QueryPerformanceCounter(&start);
+	for (i = 0; i < ICON_BENCH_ROUNDS; i++)
+		icon_bench_reference(buf, 0xff000000 | i, 0xffc0c0c0, data);
+	QueryPerformanceCounter(&mid);
+	for (i = 0; i < ICON_BENCH_ROUNDS; i++)
+		icon_tint_rows(0xff000000 | i, 0xffc0c0c0, ICON_DEFAULT_SIZE / 2, 0xff000000, 0xffc0c0c0, asset);
+	QueryPerformanceCounter(&end);
+
+	odprintf("icon[bench]: reference %.0f pixels/s, current %.0f pixels/s",
+		(double)ICON_BENCH_ROUNDS * ICON_DEFAULT_SIZE * ICON_DEFAULT_SIZE * freq.QuadPart / (mid.QuadPart - start.QuadPart + 1),
+		(double)ICON_BENCH_ROUNDS * ICON_DEFAULT_SIZE * ICON_DEFAULT_SIZE * freq.QuadPart / (end.QuadPart - mid.QuadPart + 1));
+}
+#endif
+
+int icon_init(void) {
+	odprintf("icon[init]");
+
+#if DEBUG >= 2
+	icon_bench();
+#endif
+
+	memset(icon_buf, 0, sizeof(icon_buf));
 	return 0;
 }
 
 void icon_free(void) {
-	BOOL retb;
-	DWORD err;
-
 	odprintf("icon[free]");
+}
 
-	SetLastError(0);
-	retb = DeleteObject(hbmMask);
-	err = GetLastError();
-	odprintf("DeleteObject: %s (%ld)", retb == TRUE ? "TRUE" : "FALSE", err);
+/* Icons are square, the size comes from the system's small icon metrics */
+void icon_resize(unsigned int size) {
+	if (size < 1)
+		size = ICON_DEFAULT_SIZE;
+	if (size > ICON_MAX_SIZE)
+		size = ICON_MAX_SIZE;
+
+	if (size != cur_size) {
+		odprintf("icon[resize]: size=%u", size);
+		cur_size = size;
+		memset(icon_buf, 0, sizeof(icon_buf));
+	}
+}
+
+unsigned int icon_size(void) {
+	return cur_size;
 }
 
 HICON icon_create(void) {
-	HDC hdc, hdcMem;
-	HBITMAP hbmOld, hbmIcon;
+	HBITMAP hbmIcon, hbmMask;
 	BITMAPINFO bmi;
 	ICONINFO iinfo;
 	HICON icon = NULL;
+	const unsigned char *mask;
+	unsigned int *bits;
+	unsigned int x, y, i;
 	BOOL retb;
-	INT ret;
 	DWORD err;
 
 	odprintf("icon[create]");
 
-	SetLastError(0);
-	hdc = GetDC(NULL);
-	err = GetLastError();
-	odprintf("GetDC: %p (%ld)", hdc, err);
-	if (hdc == NULL)
-		goto failed;
-
-	SetLastError(0);
-	hdcMem = CreateCompatibleDC(hdc);
-	err = GetLastError();
-	odprintf("CreateCompatibleDC: %p (%ld)", hdcMem, err);
-	if (hdcMem == NULL)
-		goto release_hdc;
-
-	SetLastError(0);
-	hbmIcon = CreateCompatibleBitmap(hdc, ICON_WIDTH, ICON_HEIGHT);
-	err = GetLastError();
-	odprintf("CreateCompatibleBitmap: %p (%ld)", hbmIcon, err);
-	if (hbmIcon == NULL)
-		goto delete_hdcMem;
-
-	SetLastError(0);
-	hbmOld = SelectObject(hdcMem, hbmIcon);
-	err = GetLastError();
-	odprintf("SelectObject: %p (%ld)", hbmOld, err);
-	if (hbmOld == NULL)
-		goto delete_hbmIcon;
-
 	bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
-	bmi.bmiHeader.biWidth = ICON_WIDTH;
-	bmi.bmiHeader.biHeight = -ICON_HEIGHT;
+	bmi.bmiHeader.biWidth = cur_size;
+	bmi.bmiHeader.biHeight = -(LONG)cur_size;
 	bmi.bmiHeader.biPlanes = 1;
-	bmi.bmiHeader.biBitCount = ICON_DEPTH_BITS;
+	bmi.bmiHeader.biBitCount = 32;
 	bmi.bmiHeader.biCompression = BI_RGB;
-	bmi.bmiHeader.biSizeImage = sizeof(icon_buf);
+	bmi.bmiHeader.biSizeImage = cur_size * cur_size * sizeof(icon_buf[0]);
 	bmi.bmiHeader.biXPelsPerMeter = 0; /* Per metre? That's a lot of pixels... */
 	bmi.bmiHeader.biYPelsPerMeter = 0;
 	bmi.bmiHeader.biClrUsed = 0;
@@ -131,17 +190,33 @@ HICON icon_create(void) {
 	bmi.bmiColors[0].rgbRed = 0;
 	bmi.bmiColors[0].rgbReserved = 0;
 
+	/* a DIB section keeps the alpha channel, whatever the display depth */
 	SetLastError(0);
-	ret = SetDIBits(hdcMem, hbmIcon, 0, ICON_HEIGHT, icon_buf, &bmi, DIB_RGB_COLORS);
+	hbmIcon = CreateDIBSection(NULL, &bmi, DIB_RGB_COLORS, (void **)&bits, NULL, 0);
 	err = GetLastError();
-	odprintf("SetDIBits: %d (%ld)", ret, err);
+	odprintf("CreateDIBSection: %p (%ld)", hbmIcon, err);
+	if (hbmIcon == NULL)
+		goto failed;
+
+	for (i = 0; i < cur_size * cur_size; i++)
+		bits[i] = icon_unpremultiply(icon_buf[i]);
+
+	/* the mask is only used where alpha isn't supported */
+	mask = icon_mask;
+	if (mask == NULL) {
+		memset(icon_and, 0, sizeof(icon_and));
+		for (y = 0; y < cur_size; y++)
+			for (x = 0; x < cur_size; x++)
+				if ((icon_buf[y * cur_size + x] >> 24) == 0)
+					icon_and[y * ICON_MASK_SCANLINE_BYTES(cur_size) + (x >> 3)] |= 0x80 >> (x & 7);
+		mask = icon_and;
+	}
 
 	SetLastError(0);
-	hbmOld = SelectObject(hdcMem, hbmOld);
+	hbmMask = CreateBitmap(cur_size, cur_size, 1, 1, mask);
 	err = GetLastError();
-	odprintf("SelectObject: %p (%ld)", hbmOld, err);
-
-	if (ret != ICON_HEIGHT)
+	odprintf("CreateBitmap: %p (%ld)", hbmMask, err);
+	if (hbmMask == NULL)
 		goto delete_hbmIcon;
 
 	iinfo.fIcon = TRUE;
@@ -155,25 +230,18 @@ HICON icon_create(void) {
 	err = GetLastError();
 	odprintf("CreateIconIndirect: %p (%ld)", icon, err);
 
-delete_hbmIcon:
 	SetLastError(0);
-	retb = DeleteObject(hbmIcon);
+	retb = DeleteObject(hbmMask);
 	err = GetLastError();
 	odprintf("DeleteObject: %s (%ld)", retb == TRUE ? "TRUE" : "FALSE", err);
 
-delete_hdcMem:
-	SetLastError(0);
-	retb = DeleteDC(hdcMem);
-	err = GetLastError();
-	odprintf("DeleteDC: %s (%ld)", retb == TRUE ? "TRUE" : "FALSE", err);
-
-release_hdc:
+delete_hbmIcon:
 	SetLastError(0);
-	ret = ReleaseDC(NULL, hdc);
+	retb = DeleteObject(hbmIcon);
 	err = GetLastError();
-	odprintf("ReleaseDC: %d (%ld)", ret, err);
+	odprintf("DeleteObject: %s (%ld)", retb == TRUE ? "TRUE" : "FALSE", err);
 
-failed:	
+failed:
 	return icon;
 }
 
@@ -191,84 +259,97 @@ void icon_destroy(HICON hIcon) {
 	/* if it failed, am I supposed to keep it around forever and try again? */
 }
 
-void icon_blit(unsigned int fg1, unsigned int bg1, unsigned int cx, unsigned int fg2, unsigned int bg2, unsigned int sx, unsigned int sy, unsigned int width, unsigned int height, const unsigned char *data) {
-	unsigned int fg, bg;
-	unsigned int x, y;
-	unsigned int row_b, col_b;
-	unsigned int c, px, py;
-
-	odprintf("icon[blit]: fg1=#%08x bg1=#%08x cx=%u fg2=#%08x bg2=#%08x sx=%u sy=%u width=%u height=%u data=%p", fg1, bg1, cx, fg2, bg2, sx, sy, width, height, data);
+/* The smallest asset that is at least the requested size */
+const struct icon_asset *icon_asset(const struct icon_asset *assets, unsigned int size) {
+	unsigned int i;
 
-	/* row width in bytes */
-	row_b = (width + 7) >> 3;
-
-	/* adjust colours for bpp */
-	fg1 = icon_bpp_adjust(fg1);
-	bg1 = icon_bpp_adjust(bg1);
-	fg2 = icon_bpp_adjust(fg2);
-	bg2 = icon_bpp_adjust(bg2);
-
-	/* use first colour scheme */
-	fg = fg1;
-	bg = bg1;
-
-	for (x = sx; x < sx+width && x < ICON_WIDTH; x++) {
-		/* byte position in row */
-		col_b = ((x - sx) >> 3);
-
-		/* bit position in byte */
-		px = ((x - sx) & 7);
+	for (i = 0; i < ICON_ASSET_SIZES - 1; i++)
+		if (assets[i].size >= size)
+			break;
+	return &assets[i];
+}
 
-		/* change to second colour scheme */
-		if (x >= cx) {
-			fg = fg2;
-			bg = bg2;
-		}
-		
-		for (y = sy; y < sy+height && y < ICON_HEIGHT; y++) {
-			/* row offset + column offset */
-			py = (row_b * (y - sy)) + col_b;
+static inline void icon_tint_row(unsigned int *dst, const unsigned int *src, unsigned int fg, unsigned int bg, unsigned int width) {
+	unsigned int x;
 
-			/* select bit from row/column byte */
-			if ((data[py] >> px) & 1)
-				c = fg;
-			else
-				c = bg;
+	/* the pixels are premultiplied white, so any channel is the coverage */
+	for (x = 0; x < width; x++)
+		dst[x] = icon_mix(fg, bg, src[x] & 0xFF);
+}
 
-			icon_set(x, y, c);
+/* Box filter, each pixel is the average of the area of the source that it
+ * covers. Distances are in units of 1/cur_size of a source pixel (and 1/src of
+ * a destination pixel) so that everything is an integer.
+ */
+static void icon_scale(const struct icon_asset *asset) {
+	unsigned int src = asset->size;
+	unsigned int x, y, sx, sy, x0, y0, wx, wy;
+	unsigned int total, start, end;
+
+	for (y = 0; y < cur_size; y++) {
+		y0 = y * src / cur_size;
+
+		for (x = 0; x < cur_size; x++) {
+			x0 = x * src / cur_size;
+			total = 0;
+
+			for (sy = y0; sy < src && sy * cur_size < (y + 1) * src; sy++) {
+				start = sy * cur_size > y * src ? sy * cur_size : y * src;
+				end = (sy + 1) * cur_size < (y + 1) * src ? (sy + 1) * cur_size : (y + 1) * src;
+				wy = end - start;
+
+				for (sx = x0; sx < src && sx * cur_size < (x + 1) * src; sx++) {
+					start = sx * cur_size > x * src ? sx * cur_size : x * src;
+					end = (sx + 1) * cur_size < (x + 1) * src ? (sx + 1) * cur_size : (x + 1) * src;
+					wx = end - start;
+
+					total += (asset->pixels[sy * src + sx] & 0xFF) * wx * wy;
+				}
+			}
+
+			/* premultiplied white, like the assets */
+			total = (total + src * src / 2) / (src * src);
+			icon_scaled[y * cur_size + x] = total * 0x01010101;
 		}
 	}
 }
 
-void icon_wipe(unsigned int bg) {
-	odprintf("icon[wipe]: bg=#%08x", bg);
-
-	/* adjust colour for bpp */
-	bg = icon_bpp_adjust(bg);
+static void icon_tint_rows(unsigned int fg1, unsigned int bg1, unsigned int cx, unsigned int fg2, unsigned int bg2, const struct icon_asset *asset) {
+	const unsigned int *pixels = asset->pixels;
+	unsigned int y;
 
-	icon_clear(0, 0, bg, 0, 0, ICON_WIDTH, ICON_HEIGHT);
-}
+	if (asset->size != cur_size) {
+		icon_scale(asset);
+		pixels = icon_scaled;
+	}
 
-void icon_clear(unsigned int bg1, unsigned int cx, unsigned int bg2, unsigned int sx, unsigned int sy, unsigned int width, unsigned int height) {
-	unsigned int x, y, bg;
+	if (cx > cur_size)
+		cx = cur_size;
 
-	odprintf("icon[clear]: bg1=#%08x cx=%u bg2=#%08x sx=%u sy=%u width=%u height=%u", bg1, cx, bg2, sx, sy, width, height);
+	fg1 = icon_premultiply(fg1);
+	bg1 = icon_premultiply(bg1);
+	fg2 = icon_premultiply(fg2);
+	bg2 = icon_premultiply(bg2);
 
-	/* adjust colours for bpp */
-	bg1 = icon_bpp_adjust(bg1);
-	bg2 = icon_bpp_adjust(bg2);
+	/* first colour scheme up to cx, then the second */
+	for (y = 0; y < cur_size; y++) {
+		icon_tint_row(icon_buf + y * cur_size, pixels + y * cur_size, fg1, bg1, cx);
+		icon_tint_row(icon_buf + y * cur_size + cx, pixels + y * cur_size + cx, fg2, bg2, cur_size - cx);
+	}
+}
 
-	/* use first colour scheme */
-	bg = bg1;
+void icon_tint(unsigned int fg1, unsigned int bg1, unsigned int cx, unsigned int fg2, unsigned int bg2, const struct icon_asset *asset) {
+	odprintf("icon[tint]: fg1=#%08x bg1=#%08x cx=%u fg2=#%08x bg2=#%08x size=%u/%u", fg1, bg1, cx, fg2, bg2, asset->size, cur_size);
 
-	for (x = sx; sx < sx+width && x < ICON_WIDTH; x++) {
-		/* change to second colour scheme */
-		if (x >= cx)
-			bg = bg2;
+	icon_tint_rows(fg1, bg1, cx, fg2, bg2, asset);
 
-		for (y = sy; sy < sy+height && y < ICON_HEIGHT; y++)
-			icon_set(x, y, bg);
-	}
+	/* the generated mask marks the pixels that only have the background */
+	if ((cx == 0 || (bg1 >> 24) == 0xFF) && (cx >= cur_size || (bg2 >> 24) == 0xFF))
+		icon_mask = icon_opaque;
+	else if ((cx == 0 || (bg1 >> 24) == 0) && (cx >= cur_size || (bg2 >> 24) == 0) && asset->size == cur_size)
+		icon_mask = asset->mask;
+	else
+		icon_mask = NULL;
 }
 
 unsigned int icon_syscolour(int element) {
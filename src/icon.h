@@ -15,18 +15,24 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define ICON_WIDTH 16
-#define ICON_HEIGHT 16
-#define ICON_DEPTH_BITS 24
-#define ICON_DEPTH_BYTES (ICON_DEPTH_BITS >> 3)
-#define ICON_MASK_SCANLINE_BYTES ((ICON_WIDTH + 15) >> 3 & ~1)
-#define ICON_DATA_SCANLINE_BYTES ((ICON_WIDTH * ICON_DEPTH_BITS + 15) >> 3 & ~1)
+#define ICON_DEFAULT_SIZE 16 /* at 96 DPI */
+#define ICON_MAX_SIZE 64
+#define ICON_MASK_SCANLINE_BYTES(size) (((size) + 15) >> 3 & ~1)
+#define ICON_BENCH_ROUNDS 10000 /* debug builds only */
 
+/* Generated by mkicons, one for each size, smallest first */
+struct icon_asset {
+	unsigned int size;
+	const unsigned int *pixels; /* premultiplied 0xAARRGGBB */
+	const unsigned char *mask; /* set where transparent */
+};
+
+void icon_resize(unsigned int size);
+unsigned int icon_size(void);
 HICON icon_create(void);
 void icon_destroy(HICON hIcon);
-void icon_blit(unsigned int fg, unsigned int bg, unsigned int cx, unsigned int fg2, unsigned int bg2, unsigned int sx, unsigned int sy, unsigned int width, unsigned int height, const unsigned char *data);
-void icon_wipe(unsigned int bg);
-void icon_clear(unsigned int bg1, unsigned int cx, unsigned int bg2, unsigned int sx, unsigned int sy, unsigned int width, unsigned int height);
+const struct icon_asset *icon_asset(const struct icon_asset *assets, unsigned int size);
+void icon_tint(unsigned int fg1, unsigned int bg1, unsigned int cx, unsigned int fg2, unsigned int bg2, const struct icon_asset *asset);
 int icon_init(void);
 void icon_free(void);
 unsigned int icon_syscolour(int element);
@@ -15,6 +15,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
 #include <windows.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -27,43 +28,607 @@
 HWND hWnd = NULL;
 HHOOK hHook = NULL;
 
-int kbd_init(HWND hWnd_, HINSTANCE hInstance) {
-	HHOOK ret;
+static HANDLE hThread = NULL;
+static DWORD threadId = 0;
+static HANDLE hReady = NULL;
+static enum kbd_input kbdInput = KBD_INPUT_HOOK;
+#if HAVE_RAWINPUT
+static HWND kbdWnd = NULL;
+#endif
+
+/* Only used by the main thread */
+static HANDLE hDevice = INVALID_HANDLE_VALUE;
+static BOOL deviceDefined = FALSE;
+
+/* Key bindings by virtual key and modifiers, fixed before the input thread starts */
+static unsigned char kbdBound[256]; /* any modifiers */
+static unsigned char kbdKeys[256][KBD_MODS]; /* enum kbd_action */
+
+/* Bindings that are registered hot keys, and bound keys that are held
+ * down (to ignore auto-repeat), only used by the input thread
+ */
+static unsigned char kbdHotkeys[256][KBD_MODS];
+static unsigned char kbdDown[256];
+
+/* Only updated by the input thread */
+static LONGLONG perfFreq = 0;
+static struct kbd_latency hookLatency;
+#if HAVE_RAWINPUT
+static struct kbd_latency rawLatency;
+#endif
+
+/* Copied by the input thread for the main thread to report, which clears
+ * reportPending when it has finished with them
+ */
+static struct kbd_latency reportHook;
+#if HAVE_RAWINPUT
+static struct kbd_latency reportRaw;
+#endif
+static volatile LONG reportPending = 0;
+
+static void kbd_hist_add(struct kbd_histogram *hist, unsigned int value) {
+	unsigned int i = 0;
+
+	while (i < KBD_HIST_BUCKETS - 1 && (value >> i) != 0)
+		i++;
+
+	hist->buckets[i]++;
+	hist->count++;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+/* Upper bound of the bucket containing the percentile */
+static unsigned int kbd_hist_percentile(const struct kbd_histogram *hist, unsigned int pc) {
+	unsigned int i, total = 0;
+	unsigned int target = (hist->count * pc + 99) / 100;
+
+	for (i = 0; i < KBD_HIST_BUCKETS; i++) {
+		total += hist->buckets[i];
+		if (total >= target)
+			return i == 0 ? 0 : (1U << i) - 1;
+	}
+	return hist->max;
+}
+
+static void kbd_report_latency(const char *name, const struct kbd_latency *latency) {
+	if (latency->delay.count == 0)
+		return;
+
+	odprintf("kbd[latency]: %s n=%u time p50<=%uus p90<=%uus p99<=%uus max=%uus, delay p50<=%ums p99<=%ums max=%ums",
+		name, latency->time.count,
+		kbd_hist_percentile(&latency->time, 50), kbd_hist_percentile(&latency->time, 90),
+		kbd_hist_percentile(&latency->time, 99), latency->time.max,
+		kbd_hist_percentile(&latency->delay, 50), kbd_hist_percentile(&latency->delay, 99),
+		latency->delay.max);
+}
+
+static inline void kbd_post(LPARAM msg, WPARAM wParam) {
+	if (PostMessage(hWnd, WM_APP_KBD, wParam, msg) != TRUE)
+		odprintf("PostMessage: FALSE (%ld)", GetLastError());
+}
+
+/* Formatting the report would hold up the input thread, so the histograms
+ * are copied and logged by the main thread instead. If it hasn't finished
+ * with the last copy then this one is skipped.
+ */
+static void kbd_report_post(void) {
+	if (InterlockedCompareExchange(&reportPending, 1, 0) != 0)
+		return;
+
+	reportHook = hookLatency;
+#if HAVE_RAWINPUT
+	reportRaw = rawLatency;
+#endif
+	if (PostMessage(hWnd, WM_APP_KBD, 0, KBD_MSG_REPORT) != TRUE)
+		InterlockedExchange(&reportPending, 0);
+}
+
+/* Both are reported together when they're being compared */
+void kbd_report(void) {
+	kbd_report_latency("hook", &reportHook);
+#if HAVE_RAWINPUT
+	kbd_report_latency("rawinput", &reportRaw);
+#endif
+	InterlockedExchange(&reportPending, 0);
+}
+
+static void kbd_latency_add(struct kbd_latency *latency, const LARGE_INTEGER *start, DWORD time) {
+	LARGE_INTEGER end;
+
+	QueryPerformanceCounter(&end);
+	if (perfFreq != 0)
+		kbd_hist_add(&latency->time, (end.QuadPart - start->QuadPart) * 1000000 / perfFreq);
+	kbd_hist_add(&latency->delay, GetTickCount() - time);
+	if ((latency->delay.count & (KBD_REPORT_INTERVAL - 1)) == 0)
+		kbd_report_post();
+}
+
+/* Open the keyboard class device so that the LED can be set directly,
+ * without generating input. Only the first keyboard is controlled.
+ */
+static void kbd_device_undefine(void) {
+	BOOL ret;
 	DWORD err;
 
-	odprintf("kbd[init]");
+	if (!deviceDefined)
+		return;
 
 	SetLastError(0);
-	ret = SetWindowsHookEx(WH_KEYBOARD_LL, kbd_hook, hInstance, 0);
+	ret = DefineDosDevice(DDD_RAW_TARGET_PATH|DDD_REMOVE_DEFINITION|DDD_EXACT_MATCH_ON_REMOVE, KBD_DEVICE_NAME, KBD_DEVICE_PATH);
 	err = GetLastError();
-	odprintf("SetWindowsHookEx: %p (%d)", ret, err);
-	if (ret == NULL)
-		return 1;
+	odprintf("DefineDosDevice[REMOVE]: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+	if (ret == TRUE)
+		deviceDefined = FALSE;
+}
+
+static void kbd_device_open(void) {
+	BOOL ret;
+	DWORD err;
+
+	SetLastError(0);
+	ret = DefineDosDevice(DDD_RAW_TARGET_PATH, KBD_DEVICE_NAME, KBD_DEVICE_PATH);
+	err = GetLastError();
+	odprintf("DefineDosDevice: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+	if (ret != TRUE)
+		return;
+	deviceDefined = TRUE;
+
+	SetLastError(0);
+	hDevice = CreateFile("\\\\.\\" KBD_DEVICE_NAME, 0, 0, NULL, OPEN_EXISTING, 0, NULL);
+	err = GetLastError();
+	odprintf("CreateFile: %p (%ld)", hDevice, err);
+
+	/* the open handle doesn't need the name any more */
+	kbd_device_undefine();
+}
+
+static void kbd_device_close(void) {
+	if (hDevice != INVALID_HANDLE_VALUE) {
+		CloseHandle(hDevice);
+		hDevice = INVALID_HANDLE_VALUE;
+	}
+
+	kbd_device_undefine();
+}
+
+static enum sl_status kbd_device_get(void) {
+	KEYBOARD_INDICATOR_PARAMETERS kip;
+	DWORD len;
+	BOOL ret;
+	DWORD err;
+
+	kip.UnitId = 0;
+	kip.LedFlags = 0;
+
+	SetLastError(0);
+	ret = DeviceIoControl(hDevice, IOCTL_KEYBOARD_QUERY_INDICATORS, NULL, 0, &kip, sizeof(kip), &len, NULL);
+	err = GetLastError();
+	odprintf("DeviceIoControl[QUERY_INDICATORS]: %s (%ld) flags=%u", ret == TRUE ? "TRUE" : "FALSE", err, kip.LedFlags);
+	if (ret != TRUE)
+		return SL_UNKNOWN;
+
+	return (kip.LedFlags & KEYBOARD_SCROLL_LOCK_ON) == 0 ? SL_OFF : SL_ON;
+}
+
+static enum sl_status kbd_device_set(enum sl_status status) {
+	KEYBOARD_INDICATOR_PARAMETERS kip;
+	DWORD len;
+	BOOL ret;
+	DWORD err;
+
+	kip.UnitId = 0;
+	kip.LedFlags = 0;
+
+	/* keep the other indicators as they are */
+	SetLastError(0);
+	ret = DeviceIoControl(hDevice, IOCTL_KEYBOARD_QUERY_INDICATORS, NULL, 0, &kip, sizeof(kip), &len, NULL);
+	err = GetLastError();
+	odprintf("DeviceIoControl[QUERY_INDICATORS]: %s (%ld) flags=%u", ret == TRUE ? "TRUE" : "FALSE", err, kip.LedFlags);
+	if (ret != TRUE)
+		return SL_UNKNOWN;
+
+	if (status == SL_ON)
+		kip.LedFlags |= KEYBOARD_SCROLL_LOCK_ON;
+	else
+		kip.LedFlags &= ~KEYBOARD_SCROLL_LOCK_ON;
+
+	SetLastError(0);
+	ret = DeviceIoControl(hDevice, IOCTL_KEYBOARD_SET_INDICATORS, &kip, sizeof(kip), NULL, 0, &len, NULL);
+	err = GetLastError();
+	odprintf("DeviceIoControl[SET_INDICATORS]: %s (%ld) flags=%u", ret == TRUE ? "TRUE" : "FALSE", err, kip.LedFlags);
+	if (ret != TRUE)
+		return SL_UNKNOWN;
+
+	return status;
+}
+
+int kbd_init(HWND hWnd_, HINSTANCE hInstance, const struct slmpc_options *opts) {
+	LARGE_INTEGER freq;
+	unsigned int i;
+	DWORD ret;
+	DWORD err;
+
+	odprintf("kbd[init]: input=%d led=%d", opts->kbd_input, opts->kbd_led);
 
 	hWnd = hWnd_;
-	hHook = ret;
+	kbdInput = opts->kbd_input;
+
+	memset(kbdBound, 0, sizeof(kbdBound));
+	memset(kbdKeys, KBD_ACTION_NONE, sizeof(kbdKeys));
+	for (i = 0; i < opts->keys_count; i++) {
+		kbdBound[opts->keys[i].vk & 0xFF] = 1;
+		kbdKeys[opts->keys[i].vk & 0xFF][opts->keys[i].mods & (KBD_MODS - 1)] = opts->keys[i].action;
+	}
+
+	if (opts->kbd_led == KBD_LED_IOCTL) {
+		kbd_device_open();
+
+		/* Windows still sets the LED from its own toggle state when the key is
+		 * pressed, but it's checked on release (after that has happened) and
+		 * then put back.
+		 */
+		if (hDevice == INVALID_HANDLE_VALUE)
+			odprintf("kbd[init]: keyboard device unavailable, using SendInput");
+	}
+
+	if (QueryPerformanceFrequency(&freq))
+		perfFreq = freq.QuadPart;
+
+	SetLastError(0);
+	hReady = CreateEvent(NULL, TRUE, FALSE, NULL);
+	err = GetLastError();
+	odprintf("CreateEvent: %p (%ld)", hReady, err);
+	if (hReady == NULL) {
+		kbd_device_close();
+		return 1;
+	}
+
+	SetLastError(0);
+	hThread = CreateThread(NULL, 0, kbd_thread, hInstance, 0, &threadId);
+	err = GetLastError();
+	odprintf("CreateThread: %p (%ld)", hThread, err);
+	if (hThread == NULL) {
+		CloseHandle(hReady);
+		kbd_device_close();
+		return 1;
+	}
+
+	/* wait for the hook to be installed */
+	SetLastError(0);
+	ret = WaitForSingleObject(hReady, INFINITE);
+	err = GetLastError();
+	odprintf("WaitForSingleObject: %lu (%ld)", ret, err);
+	CloseHandle(hReady);
+
+	if (hHook == NULL
+#if HAVE_RAWINPUT
+			&& kbdWnd == NULL
+#endif
+			) {
+		WaitForSingleObject(hThread, INFINITE);
+		CloseHandle(hThread);
+		hThread = NULL;
+		kbd_device_close();
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Modifier keys aren't part of the event, but are only checked for keys
+ * that have a binding. Returns non-zero if the key was used, in which case
+ * it (and its release) shouldn't be passed on.
+ */
+static inline int kbd_key(unsigned int vk, int up) {
+	unsigned int mods = 0;
+
+	if (vk > 0xFF || !kbdBound[vk])
+		return 0;
+
+	if (up) {
+		if (!kbdDown[vk])
+			return 0;
+
+		kbdDown[vk] = 0;
+		return 1;
+	}
+
+	/* auto-repeat, the first press has already been sent */
+	if (kbdDown[vk])
+		return 1;
+
+	if (GetAsyncKeyState(VK_CONTROL) < 0)
+		mods |= KBD_MOD_CTRL;
+	if (GetAsyncKeyState(VK_MENU) < 0)
+		mods |= KBD_MOD_ALT;
+	if (GetAsyncKeyState(VK_SHIFT) < 0)
+		mods |= KBD_MOD_SHIFT;
+	if (GetAsyncKeyState(VK_LWIN) < 0 || GetAsyncKeyState(VK_RWIN) < 0)
+		mods |= KBD_MOD_WIN;
+
+	/* hot keys have already been handled */
+	if (kbdKeys[vk][mods] == KBD_ACTION_NONE || kbdHotkeys[vk][mods])
+		return 0;
+
+	kbdDown[vk] = 1;
+	kbd_post(KBD_MSG_KEY, kbdKeys[vk][mods]);
+	return 1;
+}
+
+#if HAVE_RAWINPUT
+/* Register each binding as a hot key, so that only those key presses are
+ * sent to us. Any that are already taken (or reserved by the system) are
+ * still handled from raw input.
+ */
+static void kbd_hotkeys_register(void) {
+	unsigned int vk, mods, flags;
+	BOOL ret;
+	DWORD err;
+
+	for (vk = 0; vk < 256; vk++) {
+		if (!kbdBound[vk])
+			continue;
+
+		for (mods = 0; mods < KBD_MODS; mods++) {
+			if (kbdKeys[vk][mods] == KBD_ACTION_NONE)
+				continue;
+
+			flags = 0;
+			if (mods & KBD_MOD_CTRL)
+				flags |= MOD_CONTROL;
+			if (mods & KBD_MOD_ALT)
+				flags |= MOD_ALT;
+			if (mods & KBD_MOD_SHIFT)
+				flags |= MOD_SHIFT;
+			if (mods & KBD_MOD_WIN)
+				flags |= MOD_WIN;
+
+			/* auto-repeat can only be turned off on Windows 7 */
+			SetLastError(0);
+			ret = RegisterHotKey(kbdWnd, KBD_HOTKEY_ID(vk, mods), flags | MOD_NOREPEAT, vk);
+			if (ret != TRUE)
+				ret = RegisterHotKey(kbdWnd, KBD_HOTKEY_ID(vk, mods), flags, vk);
+			err = GetLastError();
+			odprintf("RegisterHotKey[%02x/%x]: %s (%ld)", vk, mods, ret == TRUE ? "TRUE" : "FALSE", err);
+
+			kbdHotkeys[vk][mods] = ret == TRUE;
+		}
+	}
+}
+
+static void kbd_hotkeys_unregister(void) {
+	unsigned int vk, mods;
+
+	for (vk = 0; vk < 256; vk++) {
+		for (mods = 0; mods < KBD_MODS; mods++) {
+			if (!kbdHotkeys[vk][mods])
+				continue;
+
+			UnregisterHotKey(kbdWnd, KBD_HOTKEY_ID(vk, mods));
+			kbdHotkeys[vk][mods] = 0;
+		}
+	}
+}
+
+/* Raw input is delivered to a message-only window on the input thread and,
+ * unlike the hook, doesn't hold up the key event while it is processed.
+ * Bound keys are hot keys where possible, so raw input is only needed for
+ * Scroll Lock; it can't be registered for a single key.
+ */
+static int kbd_raw_init(HINSTANCE hInstance) {
+	WNDCLASSEX wcx;
+	RAWINPUTDEVICE rid;
+	ATOM cls;
+	BOOL ret;
+	DWORD err;
+
+	wcx.cbSize = sizeof(wcx);
+	wcx.style = 0;
+	wcx.lpfnWndProc = kbd_window;
+	wcx.cbClsExtra = 0;
+	wcx.cbWndExtra = 0;
+	wcx.hInstance = hInstance;
+	wcx.hIcon = NULL;
+	wcx.hCursor = NULL;
+	wcx.hbrBackground = NULL;
+	wcx.lpszMenuName = NULL;
+	wcx.lpszClassName = KBD_WINDOW_CLASS;
+	wcx.hIconSm = NULL;
+
+	SetLastError(0);
+	cls = RegisterClassEx(&wcx);
+	err = GetLastError();
+	odprintf("RegisterClassEx: %d (%ld)", cls, err);
+	if (cls == 0)
+		return 1;
+
+	SetLastError(0);
+	kbdWnd = CreateWindowEx(0, KBD_WINDOW_CLASS, TITLE, 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, hInstance, NULL);
+	err = GetLastError();
+	odprintf("CreateWindowEx: %p (%ld)", kbdWnd, err);
+	if (kbdWnd == NULL)
+		goto unregister_class;
+
+	/* generic desktop keyboard, even when not in the foreground */
+	rid.usUsagePage = 0x01;
+	rid.usUsage = 0x06;
+	rid.dwFlags = RIDEV_INPUTSINK;
+	rid.hwndTarget = kbdWnd;
+
+	SetLastError(0);
+	ret = RegisterRawInputDevices(&rid, 1, sizeof(rid));
+	err = GetLastError();
+	odprintf("RegisterRawInputDevices: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+	if (ret == TRUE) {
+		kbd_hotkeys_register();
+		return 0;
+	}
+
+	DestroyWindow(kbdWnd);
+	kbdWnd = NULL;
+
+unregister_class:
+	UnregisterClass(KBD_WINDOW_CLASS, hInstance);
+	return 1;
+}
+
+static void kbd_raw_destroy(HINSTANCE hInstance) {
+	RAWINPUTDEVICE rid;
+	BOOL ret;
+	DWORD err;
+
+	kbd_hotkeys_unregister();
+
+	rid.usUsagePage = 0x01;
+	rid.usUsage = 0x06;
+	rid.dwFlags = RIDEV_REMOVE;
+	rid.hwndTarget = NULL;
+
+	SetLastError(0);
+	ret = RegisterRawInputDevices(&rid, 1, sizeof(rid));
+	err = GetLastError();
+	odprintf("RegisterRawInputDevices[REMOVE]: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+
+	DestroyWindow(kbdWnd);
+	kbdWnd = NULL;
+	UnregisterClass(KBD_WINDOW_CLASS, hInstance);
+}
+
+LRESULT CALLBACK kbd_window(HWND hWnd_, UINT uMsg, WPARAM wParam, LPARAM lParam) {
+	LARGE_INTEGER start;
+	RAWINPUT raw;
+	UINT size = sizeof(raw);
+	UINT ret;
+
+	if (uMsg == WM_HOTKEY) {
+		kbd_post(KBD_MSG_KEY, kbdKeys[wParam & 0xFF][(wParam >> 8) & (KBD_MODS - 1)]);
+		return 0;
+	}
+
+	if (uMsg != WM_INPUT)
+		return DefWindowProc(hWnd_, uMsg, wParam, lParam);
+
+	QueryPerformanceCounter(&start);
+
+	ret = GetRawInputData((HRAWINPUT)lParam, RID_INPUT, &raw, &size, sizeof(RAWINPUTHEADER));
+	if (ret != (UINT)-1 && raw.header.dwType == RIM_TYPEKEYBOARD
+			&& raw.data.keyboard.ExtraInformation != KBD_EXTRA_INFO) {
+		if (raw.data.keyboard.VKey == VK_SCROLL) {
+			/* see kbd_hook() */
+			if (raw.data.keyboard.Flags & RI_KEY_BREAK)
+				kbd_post(KBD_MSG_CHECK, 0);
+		} else {
+			/* raw input can't stop the key being passed on */
+			kbd_key(raw.data.keyboard.VKey, raw.data.keyboard.Flags & RI_KEY_BREAK);
+		}
+	}
+
+	kbd_latency_add(&rawLatency, &start, GetMessageTime());
+
+	/* lets the system clean up the input data */
+	return DefWindowProc(hWnd_, uMsg, wParam, lParam);
+}
+#endif
+
+/* The hook (or raw input) is handled on the thread that installed it, when
+ * that thread is waiting for messages. Doing this on its own thread means
+ * that input never has to wait for socket or tray processing on the main
+ * thread.
+ */
+DWORD WINAPI kbd_thread(LPVOID param) {
+	HINSTANCE hInstance = param;
+	MSG msg;
+	BOOL ret;
+	DWORD err;
+
+	SetLastError(0);
+	ret = SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+	err = GetLastError();
+	odprintf("SetThreadPriority: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+
+	/* create the message queue before kbd_destroy() can post to it */
+	PeekMessage(&msg, NULL, WM_USER, WM_USER, PM_NOREMOVE);
+
+#if HAVE_RAWINPUT
+	if (kbdInput == KBD_INPUT_RAW && kbd_raw_init(hInstance) != 0) {
+		odprintf("kbd[thread]: raw input unavailable, using hook");
+		kbdInput = KBD_INPUT_HOOK;
+	}
+#else
+	kbdInput = KBD_INPUT_HOOK;
+#endif
+
+	/* Debug builds also install the hook alongside raw input, where it only
+	 * records its latency, so that both are measured for the same keys.
+	 */
+	if (kbdInput == KBD_INPUT_HOOK || DEBUG >= 2) {
+		SetLastError(0);
+		hHook = SetWindowsHookEx(WH_KEYBOARD_LL, kbd_hook, hInstance, 0);
+		err = GetLastError();
+		odprintf("SetWindowsHookEx: %p (%d)", hHook, err);
+
+		if (hHook == NULL && kbdInput == KBD_INPUT_HOOK) {
+			SetEvent(hReady);
+			return 1;
+		}
+	}
+
+	SetEvent(hReady);
+
+	while (GetMessage(&msg, NULL, 0, 0) > 0)
+		DispatchMessage(&msg);
+
+	if (hHook != NULL) {
+		SetLastError(0);
+		ret = UnhookWindowsHookEx(hHook);
+		err = GetLastError();
+		odprintf("UnhookWindowsHookEx: %s (%d)", ret == TRUE ? "TRUE" : "FALSE", err);
+		hHook = NULL;
+	}
+
+#if HAVE_RAWINPUT
+	if (kbdWnd != NULL)
+		kbd_raw_destroy(hInstance);
+#endif
 
 	return 0;
 }
 
 LRESULT CALLBACK kbd_hook(int nCode, WPARAM wParam, LPARAM lParam) {
 	KBDLLHOOKSTRUCT *event;
+	LARGE_INTEGER start;
+	int used = 0;
+
+	QueryPerformanceCounter(&start);
 
 	event = (PKBDLLHOOKSTRUCT)lParam;
 
 	if (nCode < 0 || event == NULL)
 		return CallNextHookEx(hHook, nCode, wParam, lParam);
 	
-	if (event->vkCode == VK_SCROLL && (event->flags & LLKHF_UP) == 0) {
-		BOOL ret;
-		DWORD err;
-
-		SetLastError(0);
-		ret = PostMessage(hWnd, WM_APP_KBD, 0, KBD_MSG_CHECK);
-		err = GetLastError();
-		odprintf("PostMessage: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+	/* every key on the desktop comes through here, so don't log anything unless it fails;
+	 * alongside raw input (in debug builds) it is only timed
+	 */
+	if (kbdInput == KBD_INPUT_HOOK && ((event->flags & LLKHF_INJECTED) == 0 || event->dwExtraInfo != KBD_EXTRA_INFO)) {
+		if (event->vkCode == VK_SCROLL) {
+			/* The toggle state is only updated after the key down event has
+			 * been passed on, and the main thread could check it before then,
+			 * so wait for the key to be released.
+			 */
+			if (event->flags & LLKHF_UP)
+				kbd_post(KBD_MSG_CHECK, 0);
+		} else {
+			used = kbd_key(event->vkCode, event->flags & LLKHF_UP);
+		}
 	}
 
+	kbd_latency_add(&hookLatency, &start, event->time);
+
+	/* bound keys are only for us */
+	if (used)
+		return 1;
+
 	return CallNextHookEx(hHook, nCode, wParam, lParam);
 }
 
@@ -73,10 +638,27 @@ void kbd_destroy(void) {
 
 	odprintf("kbd[destroy]");
 
+	if (hThread == NULL)
+		return;
+
 	SetLastError(0);
-	ret = UnhookWindowsHookEx(hHook);
+	ret = PostThreadMessage(threadId, WM_QUIT, 0, 0);
 	err = GetLastError();
-	odprintf("UnhookWindowsHookEx: %s (%d)", ret == TRUE ? "TRUE" : "FALSE", err);
+	odprintf("PostThreadMessage: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+
+	if (ret == TRUE)
+		WaitForSingleObject(hThread, INFINITE);
+
+	CloseHandle(hThread);
+	hThread = NULL;
+
+	/* the input thread has finished with them */
+	kbd_report_latency("hook", &hookLatency);
+#if HAVE_RAWINPUT
+	kbd_report_latency("rawinput", &rawLatency);
+#endif
+
+	kbd_device_close();
 }
 
 enum sl_status kbd_get(void) {
@@ -85,6 +667,9 @@ enum sl_status kbd_get(void) {
 
 	odprintf("kbd[get]");
 
+	if (hDevice != INVALID_HANDLE_VALUE)
+		return kbd_device_get();
+
 	SetLastError(0);
 	ret = GetKeyState(VK_SCROLL);
 	err = GetLastError();
@@ -103,15 +688,22 @@ enum sl_status kbd_set(enum sl_status status) {
 
 	odprintf("kbd[set]: status=%d", status);
 
+	if (hDevice != INVALID_HANDLE_VALUE)
+		return kbd_device_set(status);
+
 	keys[0].type = INPUT_KEYBOARD;
 	keys[0].ki.wVk = VK_SCROLL;
 	keys[0].ki.wScan = 0;
 	keys[0].ki.dwFlags = 0;
+	keys[0].ki.time = 0;
+	keys[0].ki.dwExtraInfo = KBD_EXTRA_INFO;
 
 	keys[1].type = INPUT_KEYBOARD;
 	keys[1].ki.wVk = VK_SCROLL;
 	keys[1].ki.wScan = 0;
 	keys[1].ki.dwFlags = KEYEVENTF_KEYUP;
+	keys[1].ki.time = 0;
+	keys[1].ki.dwExtraInfo = KBD_EXTRA_INFO;
 
 	current = kbd_get();
 	switch (current) {
@@ -134,3 +726,23 @@ enum sl_status kbd_set(enum sl_status status) {
 
 	return current;
 }
+
+/* The state requested by a key press, given the state before it */
+enum sl_status kbd_pressed(enum sl_status previous) {
+	odprintf("kbd[pressed]: previous=%d", previous);
+
+	if (hDevice == INVALID_HANDLE_VALUE)
+		return kbd_get();
+
+	/* Windows' toggle state isn't used, so each press toggles the LED */
+	switch (previous) {
+	case SL_ON:
+		return kbd_device_set(SL_OFF);
+
+	case SL_OFF:
+		return kbd_device_set(SL_ON);
+
+	default:
+		return kbd_device_get();
+	}
+}
@@ -21,8 +21,55 @@
 
 #include "config.h"
 
-int kbd_init(HWND hWnd, HINSTANCE hInstance);
+#define KBD_HIST_BUCKETS 32
+#define KBD_REPORT_INTERVAL 1024 /* events between latency reports, power of 2 */
+#define KBD_WINDOW_CLASS "slmpc_kbd"
+
+/* Hot key ids are the virtual key and modifiers */
+#define KBD_HOTKEY_ID(vk, mods) ((vk) | ((mods) << 8))
+#ifndef MOD_NOREPEAT
+# define MOD_NOREPEAT 0x4000 /* Windows 7 */
+#endif
+
+/* Tags our own SendInput events so that the hook can ignore them */
+#define KBD_EXTRA_INFO 0x736C6D70
+
+#define KBD_DEVICE_NAME "slmpc_kbd"
+#define KBD_DEVICE_PATH "\\Device\\KeyboardClass0"
+
+/* from ntddkbd.h */
+#ifndef IOCTL_KEYBOARD_SET_INDICATORS
+#define IOCTL_KEYBOARD_SET_INDICATORS CTL_CODE(FILE_DEVICE_KEYBOARD, 0x0002, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_KEYBOARD_QUERY_INDICATORS CTL_CODE(FILE_DEVICE_KEYBOARD, 0x0010, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define KEYBOARD_SCROLL_LOCK_ON 1
+
+typedef struct _KEYBOARD_INDICATOR_PARAMETERS {
+	USHORT UnitId;
+	USHORT LedFlags;
+} KEYBOARD_INDICATOR_PARAMETERS, *PKEYBOARD_INDICATOR_PARAMETERS;
+#endif
+
+/* Power of 2 buckets: 0, 1, 2-3, 4-7, ... */
+struct kbd_histogram {
+	unsigned int buckets[KBD_HIST_BUCKETS];
+	unsigned int count;
+	unsigned int max;
+};
+
+/* For each way of receiving input */
+struct kbd_latency {
+	struct kbd_histogram time; /* microseconds handling the event */
+	struct kbd_histogram delay; /* milliseconds from the key event to handling it */
+};
+
+int kbd_init(HWND hWnd, HINSTANCE hInstance, const struct slmpc_options *opts);
+DWORD WINAPI kbd_thread(LPVOID param);
 LRESULT CALLBACK kbd_hook(int code, WPARAM wParam, LPARAM lParam);
+#if HAVE_RAWINPUT
+LRESULT CALLBACK kbd_window(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+#endif
 void kbd_destroy(void);
+void kbd_report(void);
 enum sl_status kbd_get(void);
 enum sl_status kbd_set(enum sl_status status);
+enum sl_status kbd_pressed(enum sl_status previous);
@@ -0,0 +1,325 @@
+/*
+ * Copyright ©2009  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Build host tool, converts the icon images into pixel data at each of the
+ * icon sizes so that nothing needs to be expanded at runtime.
+ *
+ * Usage: mkicons -h|-c <size>... -- <image>...
+ *
+ * Each pixel is 32bpp 0xAARRGGBB, premultiplied white with the coverage of
+ * the source image as alpha, ready to be tinted with any colour. The AND
+ * mask has a bit set (MSB first, rows padded to 16 bits) for each pixel
+ * that isn't covered at all. Images are scaled with a box filter, so sizes
+ * that aren't a multiple of the original are anti-aliased.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SIZES 16
+#define MAX_IMAGES 64
+#define MAX_NAME 64
+
+struct image {
+	char name[MAX_NAME];
+	unsigned int width;
+	unsigned int height;
+	unsigned char *bits; /* one byte per pixel, 0 or 1 */
+};
+
+static unsigned int sizes[MAX_SIZES];
+static unsigned int sizes_count = 0;
+static struct image images[MAX_IMAGES];
+static unsigned int images_count = 0;
+
+/* The name is the file name without its path or extension */
+static int image_name(struct image *img, const char *file) {
+	const char *start, *end;
+	unsigned int i;
+
+	start = strrchr(file, '/');
+	start = start == NULL ? file : start + 1;
+	end = strchr(start, '.');
+	if (end == NULL)
+		end = start + strlen(start);
+
+	if (end == start || end - start >= MAX_NAME)
+		return 1;
+
+	for (i = 0; start + i < end; i++) {
+		if (!isalnum((unsigned char)start[i]) && start[i] != '_')
+			return 1;
+		img->name[i] = start[i];
+	}
+	img->name[i] = 0;
+	return 0;
+}
+
+/* X BitMap: "#define <name>_width", "#define <name>_height", then
+ * the rows as bytes, LSB first, each row padded to a whole byte
+ */
+static int load_xbm(struct image *img, FILE *f) {
+	char line[256], *pos, *end;
+	unsigned int row_b, x, y;
+	unsigned long value;
+	unsigned char *data;
+	unsigned int len = 0, max;
+	int in_data = 0;
+
+	img->width = 0;
+	img->height = 0;
+
+	while (!in_data && fgets(line, sizeof(line), f) != NULL) {
+		if ((pos = strstr(line, "_width ")) != NULL)
+			img->width = strtoul(pos + 7, NULL, 0);
+		else if ((pos = strstr(line, "_height ")) != NULL)
+			img->height = strtoul(pos + 8, NULL, 0);
+
+		if ((pos = strchr(line, '{')) != NULL)
+			in_data = 1;
+	}
+
+	if (!in_data || img->width == 0 || img->height == 0)
+		return 1;
+
+	row_b = (img->width + 7) >> 3;
+	max = row_b * img->height;
+	data = calloc(max, 1);
+	if (data == NULL)
+		return 1;
+
+	/* the rest of the line with the opening brace, then the others */
+	pos++;
+	do {
+		while (*pos != 0 && *pos != '}') {
+			if (*pos == '0' && (pos[1] == 'x' || pos[1] == 'X')) {
+				value = strtoul(pos, &end, 16);
+				if (len == max)
+					goto failed;
+				data[len++] = value;
+				pos = end;
+			} else {
+				pos++;
+			}
+		}
+		if (*pos == '}')
+			break;
+	} while ((pos = fgets(line, sizeof(line), f)) != NULL);
+
+	if (len != max)
+		goto failed;
+
+	img->bits = calloc(img->width * img->height, 1);
+	if (img->bits == NULL)
+		goto failed;
+
+	for (y = 0; y < img->height; y++)
+		for (x = 0; x < img->width; x++)
+			img->bits[y * img->width + x] = (data[y * row_b + (x >> 3)] >> (x & 7)) & 1;
+
+	free(data);
+	return 0;
+
+failed:
+	free(data);
+	return 1;
+}
+
+/* Image loaders by file extension, each one fills in the size and bits.
+ * Only XBM is supported; PNG would need an image library on the build host.
+ */
+static const struct loader {
+	const char *ext;
+	int (*load)(struct image *img, FILE *f);
+} loaders[] = {
+	{ ".xbm", load_xbm }
+};
+
+static int load(const char *file) {
+	const struct loader *loader = NULL;
+	struct image *img;
+	const char *ext;
+	unsigned int i;
+	FILE *f;
+	int ret;
+
+	if (images_count == MAX_IMAGES) {
+		fprintf(stderr, "mkicons: too many images\n");
+		return 1;
+	}
+	img = &images[images_count];
+
+	if (image_name(img, file)) {
+		fprintf(stderr, "mkicons: %s: invalid name\n", file);
+		return 1;
+	}
+
+	ext = strrchr(file, '.');
+	for (i = 0; ext != NULL && i < sizeof(loaders) / sizeof(loaders[0]); i++)
+		if (!strcmp(ext, loaders[i].ext))
+			loader = &loaders[i];
+
+	if (loader == NULL) {
+		fprintf(stderr, "mkicons: %s: unsupported format\n", file);
+		return 1;
+	}
+
+	f = fopen(file, "rb");
+	if (f == NULL) {
+		perror(file);
+		return 1;
+	}
+
+	ret = loader->load(img, f);
+	fclose(f);
+
+	if (ret) {
+		fprintf(stderr, "mkicons: %s: unable to load\n", file);
+		return 1;
+	}
+
+	images_count++;
+	return 0;
+}
+
+/* Coverage of the area of the source image under a destination pixel */
+static unsigned int coverage(const struct image *img, unsigned int size, unsigned int dx, unsigned int dy) {
+	double x0 = (double)dx * img->width / size, x1 = (double)(dx + 1) * img->width / size;
+	double y0 = (double)dy * img->height / size, y1 = (double)(dy + 1) * img->height / size;
+	double total = 0, w, h;
+	unsigned int x, y;
+
+	for (y = (unsigned int)y0; y < img->height && y < y1; y++) {
+		h = (y + 1 < y1 ? y + 1 : y1) - (y > y0 ? y : y0);
+
+		for (x = (unsigned int)x0; x < img->width && x < x1; x++) {
+			if (!img->bits[y * img->width + x])
+				continue;
+
+			w = (x + 1 < x1 ? x + 1 : x1) - (x > x0 ? x : x0);
+			total += w * h;
+		}
+	}
+
+	return (unsigned int)(total / ((x1 - x0) * (y1 - y0)) * 255 + 0.5);
+}
+
+static void write_image(const struct image *img, unsigned int size) {
+	unsigned int mask_b = ((size + 15) >> 3) & ~1;
+	unsigned int x, y, a, i;
+	unsigned char *mask;
+
+	mask = calloc(mask_b * size, 1);
+	if (mask == NULL)
+		exit(EXIT_FAILURE);
+
+	printf("static const unsigned int %s_%u_pixels[%u] = {", img->name, size, size * size);
+	for (y = 0, i = 0; y < size; y++) {
+		for (x = 0; x < size; x++, i++) {
+			a = coverage(img, size, x, y);
+			if (a == 0)
+				mask[y * mask_b + (x >> 3)] |= 0x80 >> (x & 7);
+
+			printf("%s0x%02x%02x%02x%02x,", i % 8 == 0 ? "\n\t" : " ", a, a, a, a);
+		}
+	}
+	printf("\n};\n\n");
+
+	printf("static const unsigned char %s_%u_mask[%u] = {", img->name, size, mask_b * size);
+	for (i = 0; i < mask_b * size; i++)
+		printf("%s0x%02x,", i % 12 == 0 ? "\n\t" : " ", mask[i]);
+	printf("\n};\n\n");
+
+	free(mask);
+}
+
+static void write_source(void) {
+	unsigned int i, j;
+
+	printf("/* Generated by mkicons, do not edit */\n\n");
+	printf("#include <windows.h>\n\n");
+	printf("#include \"icon.h\"\n");
+	printf("#include \"icons.h\"\n\n");
+
+	for (i = 0; i < images_count; i++) {
+		for (j = 0; j < sizes_count; j++)
+			write_image(&images[i], sizes[j]);
+
+		printf("const struct icon_asset %s_icon[ICON_ASSET_SIZES] = {\n", images[i].name);
+		for (j = 0; j < sizes_count; j++)
+			printf("\t{ %u, %s_%u_pixels, %s_%u_mask },\n", sizes[j], images[i].name, sizes[j], images[i].name, sizes[j]);
+		printf("};\n\n");
+	}
+}
+
+static void write_header(void) {
+	unsigned int i;
+
+	printf("/* Generated by mkicons, do not edit */\n\n");
+	printf("#define ICON_ASSET_SIZES %u\n\n", sizes_count);
+
+	for (i = 0; i < images_count; i++)
+		printf("extern const struct icon_asset %s_icon[ICON_ASSET_SIZES];\n", images[i].name);
+}
+
+int main(int argc, char *argv[]) {
+	int header, i;
+
+	if (argc < 2 || (strcmp(argv[1], "-h") && strcmp(argv[1], "-c"))) {
+		fprintf(stderr, "Usage: %s -h|-c <size>... -- <image>...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	header = argv[1][1] == 'h';
+
+	for (i = 2; i < argc && strcmp(argv[i], "--"); i++) {
+		if (sizes_count == MAX_SIZES) {
+			fprintf(stderr, "mkicons: too many sizes\n");
+			return EXIT_FAILURE;
+		}
+
+		sizes[sizes_count] = strtoul(argv[i], NULL, 10);
+		if (sizes[sizes_count] == 0 || sizes[sizes_count] > 256) {
+			fprintf(stderr, "mkicons: %s: invalid size\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+
+		/* smallest first, so the runtime can stop at the first one that's big enough */
+		if (sizes_count > 0 && sizes[sizes_count] <= sizes[sizes_count - 1]) {
+			fprintf(stderr, "mkicons: sizes must be in increasing order\n");
+			return EXIT_FAILURE;
+		}
+		sizes_count++;
+	}
+
+	if (sizes_count == 0 || i == argc) {
+		fprintf(stderr, "mkicons: no sizes or images\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i++; i < argc; i++)
+		if (load(argv[i]))
+			return EXIT_FAILURE;
+
+	if (header)
+		write_header();
+	else
+		write_source();
+
+	return ferror(stdout) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright ©2009  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+
+#include "config.h"
+#include "debug.h"
+#include "slmpc.h"
+#include "netmon.h"
+
+/* The overlapped request may still complete after the window has gone,
+ * so it has to stay around until the process exits.
+ */
+static HWND hWnd = NULL;
+static HANDLE hEvent = NULL;
+static HANDLE hWait = NULL;
+static OVERLAPPED overlap;
+static int armed = 0;
+
+static VOID CALLBACK netmon_callback(PVOID param, BOOLEAN timeout) {
+	BOOL ret;
+	DWORD err;
+	(void)param;
+	(void)timeout;
+
+	SetLastError(0);
+	ret = PostMessage(hWnd, WM_APP_NET, 0, NET_MSG_CHANGED);
+	err = GetLastError();
+	odprintf("PostMessage: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+}
+
+/* Watch for local address changes, if this fails then reconnection
+ * just waits for the retry timer.
+ */
+void netmon_init(HWND hWnd_) {
+	BOOL ret;
+	DWORD err;
+
+	odprintf("netmon[init]");
+
+	hWnd = hWnd_;
+
+	SetLastError(0);
+	hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	err = GetLastError();
+	odprintf("CreateEvent: %p (%ld)", hEvent, err);
+	if (hEvent == NULL)
+		return;
+
+	SetLastError(0);
+	ret = RegisterWaitForSingleObject(&hWait, hEvent, netmon_callback, NULL, INFINITE, WT_EXECUTEDEFAULT);
+	err = GetLastError();
+	odprintf("RegisterWaitForSingleObject: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+	if (ret != TRUE) {
+		hWait = NULL;
+		CloseHandle(hEvent);
+		hEvent = NULL;
+		return;
+	}
+
+	netmon_arm();
+}
+
+/* Each request only reports one change, so this is called again
+ * every time one is received.
+ */
+void netmon_arm(void) {
+	HANDLE handle = NULL;
+	DWORD ret;
+
+	if (hEvent == NULL)
+		return;
+
+	memset(&overlap, 0, sizeof(overlap));
+	overlap.hEvent = hEvent;
+
+	ret = NotifyAddrChange(&handle, &overlap);
+	odprintf("NotifyAddrChange: %ld", ret);
+	armed = (ret == ERROR_IO_PENDING);
+}
+
+void netmon_destroy(void) {
+	BOOL ret;
+	DWORD err;
+
+	odprintf("netmon[destroy]");
+
+#if HAVE_CANCELIPCHANGENOTIFY
+	if (armed) {
+		SetLastError(0);
+		ret = CancelIPChangeNotify(&overlap);
+		err = GetLastError();
+		odprintf("CancelIPChangeNotify: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+	}
+#endif
+	armed = 0;
+
+	if (hWait != NULL) {
+		/* wait for the callback to finish */
+		SetLastError(0);
+		ret = UnregisterWaitEx(hWait, INVALID_HANDLE_VALUE);
+		err = GetLastError();
+		odprintf("UnregisterWaitEx: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
+		hWait = NULL;
+	}
+
+	/* the event is left open in case the request completes later */
+	hWnd = NULL;
+}
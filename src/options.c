@@ -0,0 +1,263 @@
+/*
+ * Copyright ©2009  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include "config.h"
+#include "debug.h"
+#include "slmpc.h"
+#include "options.h"
+
+static const struct {
+	const char *name;
+	enum kbd_action action;
+} options_actions[] = {
+	{ "next", KBD_ACTION_NEXT },
+	{ "previous", KBD_ACTION_PREVIOUS },
+	{ "stop", KBD_ACTION_STOP },
+	{ "volume_up", KBD_ACTION_VOLUME_UP },
+	{ "volume_down", KBD_ACTION_VOLUME_DOWN },
+	{ "seek_forward", KBD_ACTION_SEEK_FORWARD },
+	{ "seek_back", KBD_ACTION_SEEK_BACK }
+};
+
+static const struct {
+	const char *name;
+	unsigned int vk;
+} options_vks[] = {
+	{ "media_next", VK_MEDIA_NEXT_TRACK },
+	{ "media_prev", VK_MEDIA_PREV_TRACK },
+	{ "media_stop", VK_MEDIA_STOP },
+	{ "media_play_pause", VK_MEDIA_PLAY_PAUSE },
+	{ "volume_up", VK_VOLUME_UP },
+	{ "volume_down", VK_VOLUME_DOWN },
+	{ "volume_mute", VK_VOLUME_MUTE },
+	{ "left", VK_LEFT },
+	{ "right", VK_RIGHT },
+	{ "up", VK_UP },
+	{ "down", VK_DOWN },
+	{ "page_up", VK_PRIOR },
+	{ "page_down", VK_NEXT },
+	{ "home", VK_HOME },
+	{ "end", VK_END },
+	{ "insert", VK_INSERT },
+	{ "delete", VK_DELETE },
+	{ "pause", VK_PAUSE },
+	{ "space", VK_SPACE }
+};
+
+/* A key is a name, a single letter or digit, F1 to F24,
+ * or a virtual key code (e.g. "0xB0") with modifiers
+ * in front of it: "ctrl+alt+right"
+ */
+static int options_key(char *str, struct kbd_binding *binding) {
+	char *tok, *next, *end;
+	unsigned long n;
+	unsigned int i;
+
+	binding->vk = 0;
+	binding->mods = 0;
+
+	for (tok = str; tok != NULL; tok = next) {
+		next = strchr(tok, '+');
+		if (next != NULL)
+			*next++ = 0;
+
+		while (*tok == ' ')
+			tok++;
+		end = tok + strlen(tok);
+		while (end > tok && end[-1] == ' ')
+			*--end = 0;
+
+		/* only the last one isn't a modifier */
+		if (binding->vk != 0)
+			return 1;
+
+		if (!lstrcmpi(tok, "ctrl")) {
+			binding->mods |= KBD_MOD_CTRL;
+			continue;
+		} else if (!lstrcmpi(tok, "alt")) {
+			binding->mods |= KBD_MOD_ALT;
+			continue;
+		} else if (!lstrcmpi(tok, "shift")) {
+			binding->mods |= KBD_MOD_SHIFT;
+			continue;
+		} else if (!lstrcmpi(tok, "win")) {
+			binding->mods |= KBD_MOD_WIN;
+			continue;
+		}
+
+		for (i = 0; i < sizeof(options_vks)/sizeof(options_vks[0]); i++) {
+			if (!lstrcmpi(tok, options_vks[i].name)) {
+				binding->vk = options_vks[i].vk;
+				break;
+			}
+		}
+		if (binding->vk != 0)
+			continue;
+
+		if (tok[0] != 0 && tok[1] == 0 && ((tok[0] >= '0' && tok[0] <= '9')
+				|| (tok[0] >= 'A' && tok[0] <= 'Z') || (tok[0] >= 'a' && tok[0] <= 'z'))) {
+			/* the virtual key is the upper case character */
+			binding->vk = tok[0] >= 'a' ? tok[0] - 'a' + 'A' : tok[0];
+		} else if ((tok[0] == 'F' || tok[0] == 'f') && tok[1] >= '1' && tok[1] <= '9') {
+			n = strtoul(tok + 1, &end, 10);
+			if (*end != 0 || n < 1 || n > 24)
+				return 1;
+			binding->vk = VK_F1 + n - 1;
+		} else {
+			n = strtoul(tok, &end, 0);
+			if (tok[0] == 0 || *end != 0 || n == 0 || n > 0xFF)
+				return 1;
+			binding->vk = n;
+		}
+	}
+
+	/* Scroll Lock is already used */
+	if (binding->vk == 0 || binding->vk == VK_SCROLL)
+		return 1;
+	return 0;
+}
+
+static void options_keys(struct slmpc_options *opts) {
+	struct kbd_binding *binding;
+	char buf[OPTIONS_KEYS_LEN];
+	char *tok, *next;
+	unsigned int i;
+
+	opts->keys_count = 0;
+
+	for (i = 0; i < sizeof(options_actions)/sizeof(options_actions[0]); i++) {
+		GetPrivateProfileString("keys", options_actions[i].name, "", buf, sizeof(buf), opts->path);
+
+		for (tok = buf; buf[0] != 0 && tok != NULL; tok = next) {
+			next = strchr(tok, ',');
+			if (next != NULL)
+				*next++ = 0;
+
+			if (opts->keys_count == KBD_MAX_BINDINGS) {
+				odprintf("options[keys]: too many keys");
+				return;
+			}
+			binding = &opts->keys[opts->keys_count];
+
+			if (options_key(tok, binding) != 0) {
+				odprintf("options[keys]: %s: invalid key", options_actions[i].name);
+				continue;
+			}
+
+			binding->action = options_actions[i].action;
+			odprintf("options[keys]: %s: vk=%#x mods=%#x", options_actions[i].name, binding->vk, binding->mods);
+			opts->keys_count++;
+		}
+	}
+}
+
+/* Options are read from "slmpc.ini" alongside the executable,
+ * anything missing (including the file itself) gets the default.
+ */
+int options_load(struct slmpc_options *opts) {
+	char buf[32];
+	DWORD ret;
+	DWORD err;
+	char *ext;
+
+	odprintf("options[load]");
+
+	opts->path[0] = 0;
+
+	SetLastError(0);
+	ret = GetModuleFileName(NULL, opts->path, sizeof(opts->path));
+	err = GetLastError();
+	odprintf("GetModuleFileName: %lu (%ld)", ret, err);
+	if (ret == 0 || ret >= sizeof(opts->path) - sizeof(OPTIONS_FILE_EXT)) {
+		opts->path[0] = 0;
+	} else {
+		ext = strrchr(opts->path, '.');
+		if (ext == NULL || strchr(ext, '\\') != NULL)
+			ext = opts->path + ret;
+		strcpy(ext, OPTIONS_FILE_EXT);
+	}
+	odprintf("options[load]: path=%s", opts->path);
+
+	opts->ctl_conn = GetPrivateProfileInt("comms", "command_connection", 0, opts->path) != 0;
+	odprintf("options[load]: command_connection=%d", opts->ctl_conn);
+
+	opts->resolve_ttl = GetPrivateProfileInt("comms", "resolve_ttl", OPTIONS_RESOLVE_TTL, opts->path);
+	if (opts->resolve_ttl > OPTIONS_RESOLVE_TTL_MAX)
+		opts->resolve_ttl = OPTIONS_RESOLVE_TTL_MAX;
+	odprintf("options[load]: resolve_ttl=%u", opts->resolve_ttl);
+
+	/* milliseconds, 0 to disable */
+	opts->hb_interval = GetPrivateProfileInt("comms", "heartbeat_interval", 0, opts->path);
+	if (opts->hb_interval != 0 && opts->hb_interval < OPTIONS_HEARTBEAT_MIN)
+		opts->hb_interval = OPTIONS_HEARTBEAT_MIN;
+	odprintf("options[load]: heartbeat_interval=%u", opts->hb_interval);
+
+	opts->hb_misses = GetPrivateProfileInt("comms", "heartbeat_misses", OPTIONS_HEARTBEAT_MISSES, opts->path);
+	if (opts->hb_misses == 0)
+		opts->hb_misses = 1;
+	odprintf("options[load]: heartbeat_misses=%u", opts->hb_misses);
+
+	GetPrivateProfileString("keyboard", "input", "hook", buf, sizeof(buf), opts->path);
+	if (!lstrcmpi(buf, "rawinput"))
+		opts->kbd_input = KBD_INPUT_RAW;
+	else
+		opts->kbd_input = KBD_INPUT_HOOK;
+	odprintf("options[load]: input=%s (%d)", buf, opts->kbd_input);
+
+	GetPrivateProfileString("keyboard", "led", "input", buf, sizeof(buf), opts->path);
+	if (!lstrcmpi(buf, "ioctl"))
+		opts->kbd_led = KBD_LED_IOCTL;
+	else
+		opts->kbd_led = KBD_LED_INPUT;
+	odprintf("options[load]: led=%s (%d)", buf, opts->kbd_led);
+
+	/* milliseconds, 0 to disable */
+	opts->kbd_debounce = GetPrivateProfileInt("keyboard", "debounce", OPTIONS_DEBOUNCE, opts->path);
+	if (opts->kbd_debounce > OPTIONS_DEBOUNCE_MAX)
+		opts->kbd_debounce = OPTIONS_DEBOUNCE_MAX;
+	odprintf("options[load]: debounce=%u", opts->kbd_debounce);
+
+	options_keys(opts);
+
+	opts->optimistic = GetPrivateProfileInt("tray", "optimistic", 0, opts->path) != 0;
+	odprintf("options[load]: optimistic=%d", opts->optimistic);
+
+	opts->progress = GetPrivateProfileInt("tray", "progress", 0, opts->path) != 0;
+	odprintf("options[load]: progress=%d", opts->progress);
+
+	opts->balloon = GetPrivateProfileInt("tray", "balloon", 0, opts->path) != 0;
+	odprintf("options[load]: balloon=%d", opts->balloon);
+
+	opts->volume_step = GetPrivateProfileInt("keys", "volume_step", OPTIONS_VOLUME_STEP, opts->path);
+	if (opts->volume_step < 1 || opts->volume_step > 100)
+		opts->volume_step = OPTIONS_VOLUME_STEP;
+	odprintf("options[load]: volume_step=%d", opts->volume_step);
+
+	opts->seek_step = GetPrivateProfileInt("keys", "seek_step", OPTIONS_SEEK_STEP, opts->path);
+	if (opts->seek_step < 1)
+		opts->seek_step = OPTIONS_SEEK_STEP;
+	odprintf("options[load]: seek_step=%d", opts->seek_step);
+
+	return opts->path[0] == 0 ? 1 : 0;
+}
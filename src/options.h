@@ -0,0 +1,29 @@
+/*
+ * Copyright ©2009  Simon Arlott
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define OPTIONS_FILE_EXT ".ini"
+#define OPTIONS_RESOLVE_TTL 300 /* 5 minutes */
+#define OPTIONS_RESOLVE_TTL_MAX 86400 /* 1 day */
+#define OPTIONS_HEARTBEAT_MIN 100 /* 100 milliseconds */
+#define OPTIONS_HEARTBEAT_MISSES 3
+#define OPTIONS_DEBOUNCE 50 /* 50 milliseconds */
+#define OPTIONS_DEBOUNCE_MAX 1000 /* 1 second */
+#define OPTIONS_VOLUME_STEP 5 /* percent */
+#define OPTIONS_SEEK_STEP 10 /* seconds */
+#define OPTIONS_KEYS_LEN 256 /* longest list of keys for one action */
+
+int options_load(struct slmpc_options *opts);
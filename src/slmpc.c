@@ -17,6 +17,7 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <windows.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -25,7 +26,10 @@
 #include "debug.h"
 #include "slmpc.h"
 #include "comms.h"
+#include "clock.h"
 #include "icon.h"
+#include "netmon.h"
+#include "options.h"
 #include "tray.h"
 #include "keyboard.h"
 
@@ -52,16 +56,36 @@ int slmpc_run(HINSTANCE hInstance, HWND hWnd, char *node, char *service, char *p
 	data.node = node;
 	data.service = service;
 	data.password = password;
-	data.sl_status = kbd_get();
 
 	data.running = 0;
+	data.retry_count = 0;
+	data.retry_pending = 0;
+	data.kbd_pending = 0;
+	data.kbd_window = 0;
+	data.kbd_presses = 0;
+	data.kbd_suppressed = 0;
+	data.idle_changed = 0;
+	clock_reset(&data.clock);
+	data.status_song = -1;
+	comms_song_reset(&data.song);
+	comms_song_reset(&data.song_next);
+	data.tray_balloon = 0;
 	status = EXIT_FAILURE;
 
-	ret = kbd_init(hWnd, hInstance);
+	/* only used for retry jitter */
+	srand(GetTickCount() ^ GetCurrentProcessId());
+
+	ret = options_load(&data.opts);
+	odprintf("options_load: %d", ret);
+
+	ret = kbd_init(hWnd, hInstance, &data.opts);
 	odprintf("kbd_init: %d", ret);
 	if (ret != 0)
 		goto fail_kbd;
 
+	/* may read the LED directly, so only after kbd_init */
+	data.sl_status = kbd_get();
+
 	ret = icon_init();
 	odprintf("icon_init: %d", ret);
 	if (ret != 0)
@@ -74,12 +98,15 @@ int slmpc_run(HINSTANCE hInstance, HWND hWnd, char *node, char *service, char *p
 
 	tray_add(hWnd, &data);
 	tray_update(hWnd, &data);
+	tray_flush(hWnd, &data);
 
 	ret = comms_init(&data);
 	odprintf("comms_init: %d", ret);
 	if (ret != 0)
 		goto fail_comms;
 
+	netmon_init(hWnd);
+
 	SetLastError(0);
 	ret = PostMessage(hWnd, WM_APP_NET, 0, NET_MSG_CONNECT);
 	err = GetLastError();
@@ -120,13 +147,18 @@ int slmpc_run(HINSTANCE hInstance, HWND hWnd, char *node, char *service, char *p
 
 		TranslateMessage(&msg);
 		DispatchMessage(&msg);
+
+		if (data.running)
+			tray_flush(hWnd, &data);
 	}
 
 fail_connect:
+	netmon_destroy();
 	comms_destroy(hWnd, &data);
 
 fail_comms:
 	tray_remove(hWnd, &data);
+	tray_free(&data);
 
 fail_tray:
 	icon_free();
@@ -152,24 +184,67 @@ void slmpc_shutdown(HWND hWnd, struct slmpc_data *data, int status) {
 	PostQuitMessage(status);
 }
 
+/* Retry with an exponentially increasing delay, randomised so that
+ * clients don't all come back at once after the server restarts.
+ */
 void slmpc_retry(HWND hWnd, struct slmpc_data *data) {
+	UINT delay;
 	INT ret;
 	DWORD err;
 
-	odprintf("slmpc[retry]");
+	odprintf("slmpc[retry]: count=%u", data->retry_count);
 
 	if (data->running) {
+		delay = RETRY_MIN;
+		if (data->retry_count < 16)
+			delay <<= data->retry_count;
+		if (delay > RETRY_MAX)
+			delay = RETRY_MAX;
+		/* RAND_MAX may only be 32767, so scale it rather than using % */
+		delay = delay / 2 + (UINT)((ULONGLONG)rand() * (delay / 2 + 1) / ((ULONGLONG)RAND_MAX + 1));
+
+		data->retry_count++;
+
 		SetLastError(0);
-		ret = SetTimer(hWnd, RETRY_TIMER_ID, 5000, NULL); /* 5 seconds */
+		ret = SetTimer(hWnd, RETRY_TIMER_ID, delay, NULL);
 		err = GetLastError();
-		odprintf("SetTimer: %d (%ld)", ret, err);
+		odprintf("SetTimer[%u]: %d (%ld)", delay, ret, err);
 		if (ret == 0) {
 			mbprintf(TITLE, MB_OK|MB_ICONERROR, "Error starting connection retry timer (%ld)", err);
 			slmpc_shutdown(hWnd, data, EXIT_FAILURE);
 		}
+
+		data->retry_pending = 1;
 	}
 }
 
+/* The network has changed or the system has resumed, so don't wait
+ * for the rest of the retry delay.
+ */
+void slmpc_reconnect(HWND hWnd, struct slmpc_data *data) {
+	BOOL retb;
+	INT ret;
+	DWORD err;
+
+	odprintf("slmpc[reconnect]: pending=%d", data->retry_pending);
+
+	comms_net_changed(data);
+	data->retry_count = 0;
+
+	if (!data->retry_pending)
+		return;
+
+	SetLastError(0);
+	retb = KillTimer(hWnd, RETRY_TIMER_ID);
+	err = GetLastError();
+	odprintf("KillTimer: %s (%ld)", retb == TRUE ? "TRUE" : "FALSE", err);
+	data->retry_pending = 0;
+
+	ret = comms_connect(hWnd, data);
+	if (ret != 0)
+		slmpc_retry(hWnd, data);
+}
+
 LRESULT CALLBACK slmpc_window(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
 	struct slmpc_data *data;
 	BOOL retb;
@@ -195,6 +270,31 @@ LRESULT CALLBACK slmpc_window(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam
 			if (ret != 0)
 				slmpc_retry(hWnd, data);
 			return TRUE;
+
+#if HAVE_GETADDRINFO
+		case NET_MSG_RESOLVED:
+			ret = comms_resolved(hWnd, data, (struct comms_resolve*)wParam);
+			if (ret != 0)
+				slmpc_retry(hWnd, data);
+			return TRUE;
+#endif
+
+		case NET_MSG_CHANGED:
+			netmon_arm();
+			slmpc_reconnect(hWnd, data);
+			return TRUE;
+
+		case NET_MSG_REPLAY:
+			ret = comms_replay(hWnd, data);
+			if (ret != 0)
+				slmpc_retry(hWnd, data);
+			return TRUE;
+
+		case NET_MSG_DRAIN:
+			ret = comms_drain(hWnd, data);
+			if (ret != 0)
+				slmpc_retry(hWnd, data);
+			return TRUE;
 		}
 		break;
 
@@ -205,6 +305,16 @@ LRESULT CALLBACK slmpc_window(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam
 			if (ret != 0)
 				slmpc_retry(hWnd, data);
 			return TRUE;
+
+		case KBD_MSG_KEY:
+			ret = comms_key(hWnd, data, (enum kbd_action)wParam);
+			if (ret != 0)
+				slmpc_retry(hWnd, data);
+			return TRUE;
+
+		case KBD_MSG_REPORT:
+			kbd_report();
+			return TRUE;
 		}
 		break;
 
@@ -227,7 +337,8 @@ LRESULT CALLBACK slmpc_window(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam
 			retb = KillTimer(hWnd, RETRY_TIMER_ID);
 			err = GetLastError();
 			odprintf("KillTimer: %s (%ld)", retb == TRUE ? "TRUE" : "FALSE", err);
-			
+			data->retry_pending = 0;
+
 			ret = comms_connect(hWnd, data);
 			if (ret != 0)
 				slmpc_retry(hWnd, data);
@@ -242,6 +353,72 @@ LRESULT CALLBACK slmpc_window(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam
 			comms_timeout(hWnd, data);
 			slmpc_retry(hWnd, data);
 			return TRUE;
+
+		case CTL_CMD_TIMER_ID:
+			SetLastError(0);
+			retb = KillTimer(hWnd, CTL_CMD_TIMER_ID);
+			err = GetLastError();
+			odprintf("KillTimer: %s (%ld)", retb == TRUE ? "TRUE" : "FALSE", err);
+
+			comms_ctl_timeout(hWnd, data);
+			return TRUE;
+
+		case CTL_PING_TIMER_ID:
+			comms_ctl_ping(hWnd, data);
+			return TRUE;
+
+		case DEBOUNCE_TIMER_ID:
+			ret = comms_kbd_debounced(hWnd, data);
+			if (ret != 0)
+				slmpc_retry(hWnd, data);
+			return TRUE;
+
+		case PROGRESS_TIMER_ID:
+			tray_progress_timer(hWnd, data);
+			return TRUE;
+
+		case HEARTBEAT_TIMER_ID:
+			ret = comms_heartbeat(hWnd, data);
+			if (ret != 0)
+				slmpc_retry(hWnd, data);
+			return TRUE;
+
+		case CONNECT_TIMER_ID:
+			SetLastError(0);
+			retb = KillTimer(hWnd, CONNECT_TIMER_ID);
+			err = GetLastError();
+			odprintf("KillTimer: %s (%ld)", retb == TRUE ? "TRUE" : "FALSE", err);
+
+			ret = comms_connect_timer(hWnd, data);
+			if (ret != 0)
+				slmpc_retry(hWnd, data);
+			return TRUE;
+		}
+		break;
+
+	case WM_SYSCOLORCHANGE:
+		tray_colours(hWnd, data);
+		break;
+
+	/* only sent when per-monitor DPI aware, the new DPI is in wParam */
+	case WM_DPICHANGED:
+		tray_resize(hWnd, data, MulDiv(ICON_DEFAULT_SIZE, LOWORD(wParam), 96));
+		break;
+
+	/* before Windows 8.1 the system DPI is only applied on restart, but the
+	 * small icon size can change
+	 */
+	case WM_DISPLAYCHANGE:
+	case WM_SETTINGCHANGE:
+		tray_resize(hWnd, data, GetSystemMetrics(SM_CXSMICON));
+		break;
+
+	case WM_POWERBROADCAST:
+		switch (wParam) {
+		case PBT_APMRESUMEAUTOMATIC:
+		case PBT_APMRESUMESUSPEND:
+			slmpc_reconnect(hWnd, data);
+			return TRUE;
 		}
 		break;
 
@@ -253,6 +430,58 @@ LRESULT CALLBACK slmpc_window(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam
 	return DefWindowProc(hWnd, uMsg, wParam, lParam);
 }
 
+/* Otherwise the icons are drawn at 96 DPI and then scaled up by the system.
+ * Per-monitor awareness (Windows 8.1) is preferred so that WM_DPICHANGED is
+ * received when the DPI of the monitor changes, with system DPI awareness
+ * (Vista) as a fallback. Both are looked up at runtime so that the same
+ * build still works on XP.
+ */
+static void slmpc_dpi_aware(void) {
+	HRESULT (WINAPI *setProcessDpiAwareness)(int value);
+	BOOL (WINAPI *setProcessDPIAware)(void);
+	HMODULE shcore;
+	HRESULT hr;
+	BOOL retb;
+	DWORD err;
+
+	SetLastError(0);
+	shcore = LoadLibrary("shcore.dll");
+	err = GetLastError();
+	odprintf("LoadLibrary[shcore]: %p (%ld)", shcore, err);
+	if (shcore != NULL) {
+		SetLastError(0);
+		setProcessDpiAwareness = (HRESULT (WINAPI *)(int))(void (*)(void))GetProcAddress(shcore, "SetProcessDpiAwareness");
+		err = GetLastError();
+		odprintf("GetProcAddress[SetProcessDpiAwareness]: %p (%ld)", setProcessDpiAwareness, err);
+
+		hr = E_FAIL;
+		if (setProcessDpiAwareness != NULL) {
+			hr = setProcessDpiAwareness(PER_MONITOR_DPI_AWARE);
+			odprintf("SetProcessDpiAwareness: %#lx", (unsigned long)hr);
+		}
+
+		/* the setting is kept after the library is unloaded */
+		SetLastError(0);
+		retb = FreeLibrary(shcore);
+		err = GetLastError();
+		odprintf("FreeLibrary: %s (%ld)", retb == TRUE ? "TRUE" : "FALSE", err);
+
+		if (SUCCEEDED(hr))
+			return;
+	}
+
+	SetLastError(0);
+	setProcessDPIAware = (BOOL (WINAPI *)(void))(void (*)(void))GetProcAddress(GetModuleHandle("user32.dll"), "SetProcessDPIAware");
+	err = GetLastError();
+	odprintf("GetProcAddress[SetProcessDPIAware]: %p (%ld)", setProcessDPIAware, err);
+	if (setProcessDPIAware != NULL) {
+		SetLastError(0);
+		retb = setProcessDPIAware();
+		err = GetLastError();
+		odprintf("SetProcessDPIAware: %s (%ld)", retb == TRUE ? "TRUE" : "FALSE", err);
+	}
+}
+
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hInstancePrev, LPSTR lpCmdLine, int nShowCmd) {
 	BOOL retb;
 	HLOCAL retp;
@@ -275,6 +504,8 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hInstancePrev, LPSTR lpCmdLine
 
 	odprintf("slmpc[main]: _WIN32_WINNT=%04x _WIN32_IE=%04x", _WIN32_WINNT, _WIN32_IE);
 
+	slmpc_dpi_aware();
+
 	SetLastError(0);
 	argv = CommandLineToArgvW(GetCommandLineW(), &argc);
 	err = GetLastError();
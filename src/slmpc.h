@@ -23,11 +23,55 @@
 #define WM_APP_SOCK (WM_APP+2)
 #define WM_APP_KBD  (WM_APP+3)
 
+#ifndef WM_DPICHANGED
+# define WM_DPICHANGED 0x02E0
+#endif
+#define PER_MONITOR_DPI_AWARE 2 /* PROCESS_PER_MONITOR_DPI_AWARE, Windows 8.1 */
+
 #define NET_MSG_CONNECT 0
+#define NET_MSG_RESOLVED 1
+#define NET_MSG_CHANGED 2
+#define NET_MSG_REPLAY 3
+#define NET_MSG_DRAIN 4
 #define KBD_MSG_CHECK 1
+#define KBD_MSG_KEY 2
+#define KBD_MSG_REPORT 3
 
 #define RETRY_TIMER_ID 1
 #define CMD_TIMER_ID 2
+#define CONNECT_TIMER_ID 3
+#define CTL_CMD_TIMER_ID 4
+#define CTL_PING_TIMER_ID 5
+#define HEARTBEAT_TIMER_ID 6
+#define DEBOUNCE_TIMER_ID 7
+#define PROGRESS_TIMER_ID 8
+
+#define RETRY_MIN 1000 /* 1 second */
+#define RETRY_MAX 120000 /* 2 minutes */
+
+#define COMMS_MAX_ADDRS 16
+#define COMMS_MAX_ATTEMPTS 4
+#define COMMS_MAX_INFLIGHT 32
+#define COMMS_MAX_QUEUED 4
+#define TRAY_ICONS 6
+#define TRAY_ICON_SIZES 4 /* cached at once, for moving between monitors */
+
+#define COMMS_MAX_SKIP 8 /* next/previous per command list */
+
+#define SONG_TAG_LEN 96
+
+/* idle subsystems, see comms_events */
+#define IDLE_PLAYER 0x01
+#define IDLE_MIXER 0x02
+#define IDLE_OPTIONS 0x04
+#define IDLE_PLAYLIST 0x08
+
+#define KBD_MAX_BINDINGS 32
+#define KBD_MOD_CTRL 1
+#define KBD_MOD_ALT 2
+#define KBD_MOD_SHIFT 4
+#define KBD_MOD_WIN 8
+#define KBD_MODS 16
 
 enum conn_status {
 	NOT_CONNECTED,
@@ -50,7 +94,14 @@ enum cmd_status {
 	MPC_IDLE,
 	MPC_NOIDLE,
 	MPC_PLAY,
-	MPC_PAUSE
+	MPC_PAUSE,
+	MPC_PING,
+	MPC_LIST,
+	MPC_SKIP,
+	MPC_SEEK,
+	MPC_VOLUME,
+	MPC_STOP,
+	MPC_SONG
 };
 
 enum sl_status {
@@ -59,15 +110,171 @@ enum sl_status {
 	SL_ON
 };
 
+/* Playback position, see clock.c */
+struct mpd_clock {
+	enum play_status state;
+	DWORD elapsed; /* ms, at tick */
+	DWORD duration; /* ms, 0 if unknown */
+	DWORD tick; /* GetTickCount() */
+};
+
+/* From currentsong, the tags are UTF-8 */
+struct mpd_song {
+	long id; /* -1 if none */
+	char title[SONG_TAG_LEN]; /* or the file name */
+	char artist[SONG_TAG_LEN];
+	char album[SONG_TAG_LEN]; /* or the stream name */
+};
+
+struct tray_icons {
+	unsigned int size; /* 0 if unused */
+	DWORD used; /* GetTickCount() */
+	HICON icons[TRAY_ICONS]; /* by enum tray_icon */
+};
+
 struct tray_status {
 	enum conn_status conn;
 	enum play_status play;
+	enum play_status pending; /* requested but not confirmed yet, if known */
+	int rejected; /* the last request didn't change the state */
+	int progress; /* columns of the icon played, -1 if not shown */
+	long song; /* id of the song, -1 if none */
+	unsigned int song_tags; /* changed each time the tags do */
+	int volume; /* percent, -1 if unknown or there's no mixer */
+	int repeat;
+	int random;
 	char msg[512];
 };
 
+enum kbd_input {
+	KBD_INPUT_HOOK,
+	KBD_INPUT_RAW
+};
+
+enum kbd_led {
+	KBD_LED_INPUT,
+	KBD_LED_IOCTL
+};
+
+enum kbd_action {
+	KBD_ACTION_NONE,
+	KBD_ACTION_NEXT,
+	KBD_ACTION_PREVIOUS,
+	KBD_ACTION_STOP,
+	KBD_ACTION_VOLUME_UP,
+	KBD_ACTION_VOLUME_DOWN,
+	KBD_ACTION_SEEK_FORWARD,
+	KBD_ACTION_SEEK_BACK
+};
+
+struct kbd_binding {
+	unsigned int vk;
+	unsigned int mods; /* KBD_MOD_* */
+	enum kbd_action action;
+};
+
+struct slmpc_options {
+	char path[MAX_PATH];
+
+	int ctl_conn; /* [comms] command_connection */
+	UINT resolve_ttl; /* [comms] resolve_ttl */
+	UINT hb_interval; /* [comms] heartbeat_interval */
+	UINT hb_misses; /* [comms] heartbeat_misses */
+
+	enum kbd_input kbd_input; /* [keyboard] input */
+	enum kbd_led kbd_led; /* [keyboard] led */
+	UINT kbd_debounce; /* [keyboard] debounce */
+
+	struct kbd_binding keys[KBD_MAX_BINDINGS]; /* [keys] <action>=<key>,... */
+	unsigned int keys_count;
+	int volume_step; /* [keys] volume_step */
+	int seek_step; /* [keys] seek_step */
+
+	int optimistic; /* [tray] optimistic */
+	int progress; /* [tray] progress */
+	int balloon; /* [tray] balloon */
+};
+
+struct comms_addr {
+	struct sockaddr_storage sa;
+	int sa_len;
+	int family;
+};
+
+struct comms_attempt {
+	SOCKET s;
+	unsigned int addr;
+	DWORD start;
+};
+
+struct comms_family_stats {
+	unsigned int attempts;
+	unsigned int connects;
+	DWORD last;
+	DWORD min;
+	DWORD max;
+	DWORD total;
+};
+
+struct comms_cmd {
+	enum cmd_status cmd;
+	int list;
+	DWORD sent;
+};
+
+struct comms_conn {
+	SOCKET s;
+	UINT_PTR timer_id;
+	enum cmd_status cmd;
+
+	/* commands sent and waiting for a response, in order */
+	struct comms_cmd inflight[COMMS_MAX_INFLIGHT];
+	unsigned int inflight_head;
+	unsigned int inflight_count;
+
+	/* response timing */
+	DWORD last_response;
+	int rtt_sampled;
+	DWORD srtt;
+	DWORD rttvar;
+	DWORD rto;
+
+	char send_buf[1024];
+	unsigned int send_len;
+	int send_list;
+	int send_err;
+
+	/* Received data, lines are parsed in place. This is a linear buffer,
+	 * not a ring: an incomplete line is moved back to the start when it
+	 * runs out of space, so that every line is contiguous.
+	 */
+	char *recv_buf;
+	unsigned int recv_size;
+	unsigned int recv_start;
+	unsigned int recv_len;
+	int recv_discard;
+};
+
+#if HAVE_GETADDRINFO
+struct comms_resolve {
+	volatile LONG refs;
+	volatile LONG cancelled;
+	HWND hWnd;
+
+	char node[512];
+	char service[512];
+	struct addrinfo hints;
+
+	struct addrinfo *res;
+	INT ret;
+	DWORD err;
+};
+#endif
+
 struct slmpc_data {
 	HINSTANCE hInstance;
 	int running;
+	struct slmpc_options opts;
 
 	char *node;
 	char *service;
@@ -77,29 +284,74 @@ struct slmpc_data {
 	char hbuf[NI_MAXHOST];
 	char sbuf[NI_MAXSERV];
 	struct addrinfo hints;
-	struct addrinfo *addrs_res;
-	struct addrinfo *addrs_cur;
-#else
-	struct sockaddr_in sa4;
-	struct sockaddr_in6 sa6;
-	int family;
-	struct sockaddr *sa;
-	int sa_len;
+	struct comms_resolve *resolving;
+	DWORD addrs_time;
+	int resolve_expired;
 #endif
-	SOCKET s;
+	struct comms_addr addrs[COMMS_MAX_ADDRS];
+	unsigned int addrs_count;
+	unsigned int addrs_next;
+	struct comms_attempt attempts[COMMS_MAX_ATTEMPTS];
+	unsigned int attempts_count;
+	DWORD connect_start;
+	struct comms_family_stats connect_stats[2]; /* IPv4, IPv6 */
+	struct comms_addr conn_addr;
 
-	char parse_buf[512];
-	unsigned int parse_pos;
+	struct comms_conn conn; /* status and idle notifications */
+	struct comms_conn ctl; /* commands, if enabled */
+	int ctl_ready;
 
-	HBITMAP hbmMask;
+	int hb_outstanding;
+	unsigned int hb_misses;
+	enum cmd_status replay_cmd;
+	int replay;
 
 	UINT taskbarCreated;
 	NOTIFYICONDATA niData;
 	int tray_ok;
+	struct tray_icons tray_icons[TRAY_ICON_SIZES]; /* drawn in tray_fg/tray_bg */
+	unsigned int tray_size; /* pixels, for the current DPI */
+	unsigned int tray_fg;
+	unsigned int tray_bg;
 	struct tray_status status;
-	enum cmd_status cmd;
-	enum cmd_status pending_cmd;
+	struct tray_status tray_shown; /* last status given to the shell */
+	int tray_shown_ok;
+	int tray_dirty;
+	unsigned int tray_updates;
+	unsigned int tray_flushes;
+	unsigned int tray_unchanged;
+
+	struct mpd_clock clock;
+	unsigned int idle_changed; /* IDLE_*, since the last wake-up */
+	long status_song; /* songid from the last status, -1 if none */
+	struct mpd_song song;
+	struct mpd_song song_next; /* being received */
+	int tray_balloon; /* show the song when the tray is next updated */
+	int progress_timer;
+	HICON tray_progress; /* only the current one is kept */
+	int tray_progress_icon; /* enum tray_icon */
+	int tray_progress_column;
+	unsigned int tray_progress_size;
+
+	unsigned int retry_count;
+	int retry_pending;
+
+	/* requests waiting to be sent */
+	enum cmd_status queue[COMMS_MAX_QUEUED];
+	unsigned int queue_count;
+	int drain_posted;
+
+	/* key binding requests waiting to be sent, merged together */
+	int key_skip; /* next if positive, previous if negative */
+	int key_seek;
+	int key_volume;
+	int key_stop;
+
 	enum sl_status sl_status;
+	int kbd_window; /* a press was sent less than the debounce time ago */
+	int kbd_pending; /* a later one is waiting for the debounce timer */
+	unsigned int kbd_presses;
+	unsigned int kbd_suppressed;
 };
 
 void slmpc_shutdown(HWND hWnd, struct slmpc_data *data, int status);
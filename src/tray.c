@@ -19,6 +19,7 @@
 #include <shlwapi.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <windows.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -29,14 +30,225 @@
 #include "slmpc.h"
 #include "comms.h"
 #include "tray.h"
+#include "clock.h"
+#include "icons.h"
+
+#ifndef IS_LOW_SURROGATE
+# define IS_LOW_SURROGATE(c) ((c) >= 0xDC00 && (c) <= 0xDFFF)
+#endif
+
+static const struct icon_asset *tray_images[TRAY_ICONS] = {
+	[TRAY_ICON_NOT_CONNECTED] = not_connected_icon,
+	[TRAY_ICON_CONNECTING] = connecting_icon,
+	[TRAY_ICON_UNKNOWN] = unknown_icon,
+	[TRAY_ICON_PLAYING] = playing_icon,
+	[TRAY_ICON_PAUSED] = paused_icon,
+	[TRAY_ICON_STOPPED] = stopped_icon
+};
+
+/* The cache for the current size, reusing the least recently used one
+ * if it isn't there. Each DPI that the icon is shown at has its own icons
+ * so moving between monitors doesn't redraw them every time.
+ */
+static struct tray_icons *tray_icons(struct slmpc_data *data) {
+	struct tray_icons *cache = &data->tray_icons[0];
+	DWORD now = GetTickCount();
+	unsigned int i, j;
+
+	for (i = 0; i < TRAY_ICON_SIZES; i++) {
+		if (data->tray_icons[i].size == data->tray_size) {
+			cache = &data->tray_icons[i];
+			cache->used = now;
+			return cache;
+		}
+
+		if (data->tray_icons[i].size == 0)
+			cache = &data->tray_icons[i];
+		else if (cache->size != 0 && now - data->tray_icons[i].used > now - cache->used)
+			cache = &data->tray_icons[i];
+	}
+
+	odprintf("tray[icons]: size=%u replacing=%u", data->tray_size, cache->size);
+
+	for (j = 0; j < TRAY_ICONS; j++) {
+		if (cache->icons[j] != NULL) {
+			if (data->niData.hIcon == cache->icons[j])
+				data->niData.hIcon = NULL;
+			icon_destroy(cache->icons[j]);
+			cache->icons[j] = NULL;
+		}
+	}
+	cache->size = data->tray_size;
+	cache->used = now;
+	return cache;
+}
+
+/* Each icon is only drawn the first time it's needed at each size,
+ * until the system colours change
+ */
+static HICON tray_icon(struct slmpc_data *data, enum tray_icon icon) {
+	struct tray_icons *cache;
+	unsigned int fg, bg;
+
+	fg = icon_syscolour(COLOR_BTNTEXT);
+	bg = icon_syscolour(COLOR_3DFACE);
+
+	/* in case WM_SYSCOLORCHANGE was missed */
+	if (fg != data->tray_fg || bg != data->tray_bg) {
+		tray_free(data);
+		data->tray_fg = fg;
+		data->tray_bg = bg;
+	}
+
+	cache = tray_icons(data);
+	if (cache->icons[icon] != NULL)
+		return cache->icons[icon];
+
+	odprintf("tray[icon]: icon=%d size=%u fg=#%08x bg=#%08x", icon, cache->size, fg, bg);
+
+	icon_resize(cache->size);
+	icon_tint(0, 0, 0, fg, bg, icon_asset(tray_images[icon], icon_size()));
+
+	cache->icons[icon] = icon_create();
+	return cache->icons[icon];
+}
+
+/* The part of the song that has been played is drawn in the highlight
+ * colours. That changes at most once per column, so only the current
+ * icon is kept.
+ */
+static HICON tray_progress_icon(struct slmpc_data *data, enum tray_icon icon, int column) {
+	unsigned int fg, bg;
+
+	/* draws (and caches) the plain icon if the colours have changed */
+	if (tray_icon(data, icon) == NULL)
+		return NULL;
+
+	if (data->tray_progress != NULL && data->tray_progress_icon == (int)icon
+			&& data->tray_progress_column == column && data->tray_progress_size == data->tray_size)
+		return data->tray_progress;
+
+	if (data->tray_progress != NULL) {
+		icon_destroy(data->tray_progress);
+		data->tray_progress = NULL;
+	}
+
+	fg = icon_syscolour(COLOR_HIGHLIGHTTEXT);
+	bg = icon_syscolour(COLOR_HIGHLIGHT);
+	odprintf("tray[progress_icon]: icon=%d column=%d size=%u fg=#%08x bg=#%08x", icon, column, data->tray_size, fg, bg);
+
+	icon_resize(data->tray_size);
+	icon_tint(fg, bg, column, data->tray_fg, data->tray_bg, icon_asset(tray_images[icon], icon_size()));
+
+	data->tray_progress = icon_create();
+	data->tray_progress_icon = icon;
+	data->tray_progress_column = column;
+	data->tray_progress_size = data->tray_size;
+	return data->tray_progress;
+}
+
+/* How much of the song has been played, in columns of the icon. It isn't
+ * polled from the server, the timer is only set for when the next column
+ * will be reached.
+ */
+static void tray_progress(HWND hWnd, struct slmpc_data *data) {
+	struct tray_status *status = &data->status;
+	DWORD elapsed, duration = clock_duration(&data->clock);
+	unsigned int size = data->tray_size;
+	UINT delay = 0;
+	UINT_PTR ret;
+	BOOL retb;
+	DWORD err;
 
-#include "connecting.xbm"
-#include "not_connected.xbm"
+	status->progress = -1;
 
-#include "unknown.xbm"
-#include "playing.xbm"
-#include "paused.xbm"
-#include "stopped.xbm"
+	if (data->opts.progress && status->conn == CONNECTED && duration != 0
+			&& (status->play == MPD_PLAYING || status->play == MPD_PAUSED)) {
+		elapsed = clock_elapsed(&data->clock);
+		status->progress = (ULONGLONG)elapsed * size / duration;
+
+		/* the first ms of the next column */
+		if (clock_running(&data->clock) && status->progress < (int)size)
+			delay = ((ULONGLONG)(status->progress + 1) * duration + size - 1) / size - elapsed;
+	}
+
+	if (delay != 0) {
+		SetLastError(0);
+		ret = SetTimer(hWnd, PROGRESS_TIMER_ID, delay, NULL);
+		err = GetLastError();
+		odprintf("SetTimer[%u]: %d (%ld)", delay, ret, err);
+		data->progress_timer = ret != 0;
+	} else if (data->progress_timer) {
+		SetLastError(0);
+		retb = KillTimer(hWnd, PROGRESS_TIMER_ID);
+		err = GetLastError();
+		odprintf("KillTimer: %s (%ld)", retb == TRUE ? "TRUE" : "FALSE", err);
+		data->progress_timer = 0;
+	}
+}
+
+/* The next column has been reached */
+void tray_progress_timer(HWND hWnd, struct slmpc_data *data) {
+	BOOL retb;
+	DWORD err;
+
+	SetLastError(0);
+	retb = KillTimer(hWnd, PROGRESS_TIMER_ID);
+	err = GetLastError();
+	odprintf("KillTimer: %s (%ld)", retb == TRUE ? "TRUE" : "FALSE", err);
+	data->progress_timer = 0;
+
+	tray_update(hWnd, data);
+}
+
+/* Destroy the cached icons, the tray icon itself keeps working
+ * because the shell has its own copy
+ */
+void tray_free(struct slmpc_data *data) {
+	unsigned int i, j;
+
+	odprintf("tray[free]");
+
+	for (i = 0; i < TRAY_ICON_SIZES; i++) {
+		for (j = 0; j < TRAY_ICONS; j++) {
+			if (data->tray_icons[i].icons[j] != NULL) {
+				icon_destroy(data->tray_icons[i].icons[j]);
+				data->tray_icons[i].icons[j] = NULL;
+			}
+		}
+		data->tray_icons[i].size = 0;
+	}
+	if (data->tray_progress != NULL) {
+		icon_destroy(data->tray_progress);
+		data->tray_progress = NULL;
+	}
+	data->niData.hIcon = NULL;
+}
+
+void tray_colours(HWND hWnd, struct slmpc_data *data) {
+	odprintf("tray[colours]");
+
+	tray_free(data);
+	data->tray_shown_ok = 0;
+	tray_update(hWnd, data);
+}
+
+/* The DPI has changed, or the small icon size has been changed */
+void tray_resize(HWND hWnd, struct slmpc_data *data, int size) {
+	odprintf("tray[resize]: size=%d current=%u", size, data->tray_size);
+
+	if (size <= 0)
+		size = ICON_DEFAULT_SIZE;
+	if (size > ICON_MAX_SIZE)
+		size = ICON_MAX_SIZE;
+
+	if ((unsigned int)size == data->tray_size)
+		return;
+
+	data->tray_size = size;
+	data->tray_shown_ok = 0;
+	tray_update(hWnd, data);
+}
 
 int tray_init(struct slmpc_data *data) {
 	UINT ret;
@@ -45,7 +257,30 @@ int tray_init(struct slmpc_data *data) {
 	odprintf("tray[init]");
 
 	data->status.conn = NOT_CONNECTED;
+	data->status.play = MPD_UNKNOWN;
+	data->status.pending = MPD_UNKNOWN;
+	data->status.rejected = 0;
+	data->status.progress = -1;
+	data->status.song = -1;
+	data->status.song_tags = 0;
+	data->status.volume = -1;
+	data->status.repeat = 0;
+	data->status.random = 0;
 	data->tray_ok = 0;
+	data->tray_shown_ok = 0;
+	data->tray_dirty = 0;
+	memset(data->tray_icons, 0, sizeof(data->tray_icons));
+	data->tray_size = GetSystemMetrics(SM_CXSMICON);
+	odprintf("GetSystemMetrics[SM_CXSMICON]: %u", data->tray_size);
+	if (data->tray_size == 0 || data->tray_size > ICON_MAX_SIZE)
+		data->tray_size = ICON_DEFAULT_SIZE;
+	data->tray_fg = 0;
+	data->tray_bg = 0;
+	data->tray_updates = 0;
+	data->tray_flushes = 0;
+	data->tray_unchanged = 0;
+	data->progress_timer = 0;
+	data->tray_progress = NULL;
 
 	SetLastError(0);
 	ret = RegisterWindowMessage(TEXT("TaskbarCreated"));
@@ -68,10 +303,12 @@ void tray_reset(HWND hWnd, struct slmpc_data *data) {
 
 	/* Assume it has been removed */
 	data->tray_ok = 0;
+	data->tray_shown_ok = 0;
 
 	/* Add it again */
 	tray_add(hWnd, data);
 	tray_update(hWnd, data);
+	tray_flush(hWnd, data);
 }
 
 void tray_add(HWND hWnd, struct slmpc_data *data) {
@@ -96,8 +333,10 @@ void tray_add(HWND hWnd, struct slmpc_data *data) {
 		ret = Shell_NotifyIcon(NIM_ADD, niData);
 		err = GetLastError();
 		odprintf("Shell_NotifyIcon[ADD]: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
-		if (ret == TRUE)
+		if (ret == TRUE) {
 			data->tray_ok = 1;
+			data->tray_shown_ok = 0;
+		}
 
 		SetLastError(0);
 		ret = Shell_NotifyIcon(NIM_SETVERSION, niData);
@@ -126,14 +365,158 @@ void tray_remove(HWND hWnd, struct slmpc_data *data) {
 	}
 }
 
+/* The status can change several times while handling one message, so the
+ * tray is only updated once the message loop has finished handling it.
+ */
 void tray_update(HWND hWnd, struct slmpc_data *data) {
+	data->tray_updates++;
+
+	if (data->tray_dirty)
+		return;
+	data->tray_dirty = 1;
+
+	/* sent messages are handled inside GetMessage(), so make sure it returns */
+	if (InSendMessage())
+		PostMessage(hWnd, WM_NULL, 0, 0);
+}
+
+static int tray_unchanged(struct slmpc_data *data) {
+	const struct tray_status *status = &data->status;
+	const struct tray_status *shown = &data->tray_shown;
+
+	return data->tray_shown_ok && status->conn == shown->conn
+		&& status->play == shown->play && status->pending == shown->pending
+		&& status->rejected == shown->rejected && status->progress == shown->progress
+		&& status->song == shown->song && status->song_tags == shown->song_tags
+		&& status->volume == shown->volume
+		&& status->repeat == shown->repeat && status->random == shown->random
+		&& !strcmp(status->msg, shown->msg);
+}
+
+/* Append a UTF-8 string in the ANSI code page, cutting it off at a
+ * character boundary if there isn't enough room
+ */
+static void tray_append(char *buf, size_t size, const char *sep, const char *text) {
+	WCHAR wbuf[SONG_TAG_LEN];
+	size_t start = strlen(buf), len = start;
+	int wlen, ret;
+
+	if (text[0] == 0 || len + 1 >= size)
+		return;
+
+	if (len != 0) {
+		ret = snprintf(buf + len, size - len, "%s", sep);
+		if (ret < 0 || (size_t)ret >= size - len - 1) {
+			buf[start] = 0;
+			return;
+		}
+		len += ret;
+	}
+
+	wlen = MultiByteToWideChar(CP_UTF8, 0, text, -1, wbuf, SONG_TAG_LEN);
+	if (wlen <= 1) {
+		buf[start] = 0;
+		return;
+	}
+	wlen--;
+
+	/* it fails completely if the result doesn't fit */
+	for (;;) {
+		ret = WideCharToMultiByte(CP_ACP, 0, wbuf, wlen, buf + len, size - len - 1, NULL, NULL);
+		if (ret > 0 && (size_t)ret <= size - len - 1)
+			break;
+		ret = 0;
+
+		/* without splitting a surrogate pair */
+		wlen--;
+		while (wlen > 0 && IS_LOW_SURROGATE(wbuf[wlen]))
+			wlen--;
+		if (wlen <= 0)
+			break;
+	}
+
+	if (ret == 0)
+		buf[start] = 0;
+	else
+		buf[len + ret] = 0;
+}
+
+/* Title, artist and album on separate lines under the state */
+static void tray_song(struct slmpc_data *data, char *buf, size_t size) {
+	const struct mpd_song *song = &data->song;
+
+	if (song->id == -1)
+		return;
+
+	tray_append(buf, size, "\n", song->title);
+	tray_append(buf, size, "\n", song->artist);
+	tray_append(buf, size, "\n", song->album);
+}
+
+/* Volume (mixer) and repeat/random (options) on the last line */
+static void tray_options(struct slmpc_data *data, char *buf, size_t size) {
+	const struct tray_status *status = &data->status;
+	char text[64] = "";
+	int ret;
+
+	if (status->volume >= 0) {
+		ret = snprintf(text, sizeof(text), "Volume %d%%", status->volume);
+		if (ret < 0)
+			text[0] = 0;
+	}
+
+	tray_append(text, sizeof(text), ", ", status->repeat ? "repeat" : "");
+	tray_append(text, sizeof(text), ", ", status->random ? "random" : "");
+	tray_append(buf, size, "\n", text);
+}
+
+/* The song has changed, so show it in a balloon until it's clicked on or
+ * times out. It's only shown once, the flag is removed afterwards.
+ */
+static void tray_balloon(struct slmpc_data *data) {
+	NOTIFYICONDATA *niData = &data->niData;
+	const struct mpd_song *song = &data->song;
+
+	niData->uFlags &= ~NIF_INFO;
+	if (!data->tray_balloon)
+		return;
+	data->tray_balloon = 0;
+
+	if (song->id == -1)
+		return;
+
+	niData->szInfoTitle[0] = 0;
+	tray_append(niData->szInfoTitle, sizeof(niData->szInfoTitle), "", song->title);
+
+	niData->szInfo[0] = 0;
+	tray_append(niData->szInfo, sizeof(niData->szInfo), "\n", song->artist);
+	tray_append(niData->szInfo, sizeof(niData->szInfo), "\n", song->album);
+
+	/* there has to be some text for it to be shown */
+	if (niData->szInfo[0] == 0) {
+		niData->szInfo[0] = ' ';
+		niData->szInfo[1] = 0;
+	}
+
+	niData->dwInfoFlags = NIIF_INFO;
+	niData->uFlags |= NIF_INFO;
+}
+
+void tray_flush(HWND hWnd, struct slmpc_data *data) {
 	struct tray_status *status = &data->status;
 	NOTIFYICONDATA *niData = &data->niData;
-	HICON oldIcon;
-	unsigned int fg, bg;
+	enum play_status play;
+	enum tray_icon icon;
+	size_t len;
 	BOOL ret;
 	DWORD err;
 
+	if (!data->tray_dirty)
+		return;
+	data->tray_dirty = 0;
+
+	tray_progress(hWnd, data);
+
 	if (!data->tray_ok) {
 		tray_add(hWnd, data);
 
@@ -141,17 +524,21 @@ void tray_update(HWND hWnd, struct slmpc_data *data) {
 			return;
 	}
 
-	odprintf("tray[update]: conn=%d play=%d msg=\"%s\"", status->conn, status->play, status->msg);
+	if (tray_unchanged(data)) {
+		data->tray_unchanged++;
+		return;
+	}
+	data->tray_flushes++;
 
-	fg = icon_syscolour(COLOR_BTNTEXT);
-	bg = icon_syscolour(COLOR_3DFACE);
+	odprintf("tray[flush]: updates=%u flushes=%u unchanged=%u", data->tray_updates, data->tray_flushes, data->tray_unchanged);
+	odprintf("tray[update]: conn=%d play=%d pending=%d rejected=%d progress=%d msg=\"%s\"", status->conn, status->play, status->pending, status->rejected, status->progress, status->msg);
+
+	/* show what was asked for until the server says otherwise */
+	play = status->pending != MPD_UNKNOWN ? status->pending : status->play;
 
 	switch (status->conn) {
 	case NOT_CONNECTED:
-		if (not_connected_width < ICON_WIDTH || not_connected_height < ICON_HEIGHT)
-			icon_wipe(bg);
-
-		icon_blit(0, 0, 0, fg, bg, 0, 0, not_connected_width, not_connected_height, not_connected_bits);
+		icon = TRAY_ICON_NOT_CONNECTED;
 
 		if (status->msg[0] != 0)
 			ret = snprintf(niData->szTip, sizeof(niData->szTip), "Not Connected: %s", status->msg);
@@ -162,10 +549,7 @@ void tray_update(HWND hWnd, struct slmpc_data *data) {
 		break;
 
 	case CONNECTING:
-		if (connecting_width < ICON_WIDTH || connecting_height < ICON_HEIGHT)
-			icon_wipe(bg);
-
-		icon_blit(0, 0, 0, fg, bg, 0, 0, connecting_width, connecting_height, connecting_bits);
+		icon = TRAY_ICON_CONNECTING;
 
 		if (status->msg[0] != 0)
 			ret = snprintf(niData->szTip, sizeof(niData->szTip), "Connecting to %s", status->msg);
@@ -176,12 +560,9 @@ void tray_update(HWND hWnd, struct slmpc_data *data) {
 		break;
 
 	case CONNECTED:
-		switch (status->play) {
+		switch (play) {
 		case MPD_UNKNOWN:
-			if (unknown_width < ICON_WIDTH || unknown_height < ICON_HEIGHT)
-				icon_wipe(bg);
-
-			icon_blit(0, 0, 0, fg, bg, 0, 0, unknown_width, unknown_height, unknown_bits);
+			icon = TRAY_ICON_UNKNOWN;
 
 			if (status->msg[0] != 0)
 				ret = snprintf(niData->szTip, sizeof(niData->szTip), "Connected to %s", status->msg);
@@ -192,10 +573,7 @@ void tray_update(HWND hWnd, struct slmpc_data *data) {
 			break;
 
 		case MPD_PLAYING:
-			if (playing_width < ICON_WIDTH || playing_height < ICON_HEIGHT)
-				icon_wipe(bg);
-
-			icon_blit(0, 0, 0, fg, bg, 0, 0, playing_width, playing_height, playing_bits);
+			icon = TRAY_ICON_PLAYING;
 
 			if (status->msg[0] != 0)
 				ret = snprintf(niData->szTip, sizeof(niData->szTip), "Playing: %s", status->msg);
@@ -206,10 +584,7 @@ void tray_update(HWND hWnd, struct slmpc_data *data) {
 			break;
 
 		case MPD_PAUSED:
-			if (paused_width < ICON_WIDTH || paused_height < ICON_HEIGHT)
-				icon_wipe(bg);
-
-			icon_blit(0, 0, 0, fg, bg, 0, 0, paused_width, paused_height, paused_bits);
+			icon = TRAY_ICON_PAUSED;
 
 			if (status->msg[0] != 0)
 				ret = snprintf(niData->szTip, sizeof(niData->szTip), "Paused: %s", status->msg);
@@ -220,10 +595,7 @@ void tray_update(HWND hWnd, struct slmpc_data *data) {
 			break;
 
 		case MPD_STOPPED:
-			if (stopped_width < ICON_WIDTH || stopped_height < ICON_HEIGHT)
-				icon_wipe(bg);
-
-			icon_blit(0, 0, 0, fg, bg, 0, 0, stopped_width, stopped_height, stopped_bits);
+			icon = TRAY_ICON_STOPPED;
 
 			if (status->msg[0] != 0)
 				ret = snprintf(niData->szTip, sizeof(niData->szTip), "Stopped %s", status->msg);
@@ -233,16 +605,34 @@ void tray_update(HWND hWnd, struct slmpc_data *data) {
 				niData->szTip[0] = 0;
 			break;
 		}
+
+		len = strlen(niData->szTip);
+		if (status->pending != MPD_UNKNOWN)
+			ret = snprintf(niData->szTip + len, sizeof(niData->szTip) - len, " (requested)");
+		else if (status->rejected)
+			ret = snprintf(niData->szTip + len, sizeof(niData->szTip) - len, " (request failed)");
+		else
+			ret = 0;
+		if (ret < 0)
+			niData->szTip[len] = 0;
+
+		if (play == MPD_PLAYING || play == MPD_PAUSED)
+			tray_song(data, niData->szTip, sizeof(niData->szTip));
+		tray_options(data, niData->szTip, sizeof(niData->szTip));
 		break;
 
 	default:
 		return;
 	}
 
-	oldIcon = niData->hIcon;
+	tray_balloon(data);
 
+	/* the shell makes its own copy of the icon */
 	niData->uFlags &= ~NIF_ICON;
-	niData->hIcon = icon_create();
+	if (status->progress > 0)
+		niData->hIcon = tray_progress_icon(data, icon, status->progress);
+	else
+		niData->hIcon = tray_icon(data, icon);
 	if (niData->hIcon != NULL)
 		niData->uFlags |= NIF_ICON;
 
@@ -250,11 +640,13 @@ void tray_update(HWND hWnd, struct slmpc_data *data) {
 	ret = Shell_NotifyIcon(NIM_MODIFY, niData);
 	err = GetLastError();
 	odprintf("Shell_NotifyIcon[MODIFY]: %s (%ld)", ret == TRUE ? "TRUE" : "FALSE", err);
-	if (ret != TRUE)
+	niData->uFlags &= ~NIF_INFO;
+	if (ret != TRUE) {
 		tray_remove(hWnd, data);
-
-	if (oldIcon != NULL)
-		icon_destroy(niData->hIcon);
+	} else {
+		data->tray_shown = *status;
+		data->tray_shown_ok = 1;
+	}
 }
 
 BOOL tray_activity(HWND hWnd, struct slmpc_data *data, WPARAM wParam, LPARAM lParam) {
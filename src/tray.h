@@ -20,9 +20,23 @@
 #define COLOUR_WHITE 0xffffffff
 #define COLOUR_BLACK 0x00000000
 
+enum tray_icon {
+	TRAY_ICON_NOT_CONNECTED,
+	TRAY_ICON_CONNECTING,
+	TRAY_ICON_UNKNOWN,
+	TRAY_ICON_PLAYING,
+	TRAY_ICON_PAUSED,
+	TRAY_ICON_STOPPED
+};
+
 int tray_init(struct slmpc_data *data);
+void tray_free(struct slmpc_data *data);
+void tray_colours(HWND hWnd, struct slmpc_data *data);
+void tray_resize(HWND hWnd, struct slmpc_data *data, int size);
 void tray_reset(HWND hWnd, struct slmpc_data *data);
 void tray_add(HWND hWnd, struct slmpc_data *data);
 void tray_update(HWND hWnd, struct slmpc_data *data);
+void tray_flush(HWND hWnd, struct slmpc_data *data);
+void tray_progress_timer(HWND hWnd, struct slmpc_data *data);
 BOOL tray_activity(HWND hWnd, struct slmpc_data *data, WPARAM wParam, LPARAM lParam);
 void tray_remove(HWND hWnd, struct slmpc_data *data);